@@ -8,8 +8,21 @@ int printf(const char *fmt, ...);
 int vprintf(const char *fmt, va_list vargs);
 void putchar(char ch);
 
+// stdioのバッファリングの方式 (setvbuf)
+#define BUFSIZ 512
+#define _IOFBF 0 // バッファが一杯になったら書き出す
+#define _IOLBF 1 // 改行ごとに書き出す
+#define _IONBF 2 // バッファリングしない
+
 typedef struct FILE {
   int fd;
+  int buf_mode;
+  char *buf;
+  int buf_size;
+  int buf_pos; // 次に読み書きするバッファ内の位置
+  int buf_len; // 読み込み時: バッファ内の有効なバイト数
+  bool writing; // バッファが書き込み待ちのデータを持っている
+  char default_buf[BUFSIZ];
 } FILE;
 
 void *memset(void *buf, int c, size_t n);
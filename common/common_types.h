@@ -33,6 +33,16 @@ typedef uint8_t bool;
 #define SYS_FGETC 9
 #define SYS_FPUTC 10
 #define SYS_SHUTDOWN 11
+#define SYS_READ 12
+#define SYS_WRITE 13
+#define SYS_LSEEK 14
+#define SYS_PREAD 15
+#define SYS_PWRITE 16
+
+// lseekの基準位置
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
 
 #define EOF (-1)
 
@@ -0,0 +1,290 @@
+#include "bcache.h"
+#include "blk.h"
+#include "kernel.h"
+
+struct bcache_buf {
+  unsigned sector;
+  bool valid;
+  uint8_t *data;
+  struct bcache_buf *hash_next;
+  // LRUリスト。bcache_lru.nextが最近使ったもの、prevが次に追い出すもの
+  struct bcache_buf *lru_prev;
+  struct bcache_buf *lru_next;
+};
+
+static struct bcache_buf *bcache_bufs;
+static struct bcache_buf *bcache_hash[BCACHE_HASH_SIZE];
+static struct bcache_buf bcache_lru;
+
+// 完了を待たずに発行した先読み。読み終えたらキャッシュに入れる
+struct bcache_ra {
+  struct virtio_blk_io io;
+  unsigned sector;
+  unsigned count; // 0なら空き
+  bool stale;     // 発行後に範囲内へ書き込みがあったので、結果を捨てる
+  uint8_t *data;
+};
+
+static struct bcache_ra bcache_ras[BCACHE_RA_SLOTS];
+
+static unsigned pages_for(unsigned size) {
+  return align_up(size, PAGE_SIZE) / PAGE_SIZE;
+}
+
+void bcache_init(void) {
+  bcache_bufs = (struct bcache_buf *)alloc_pages(
+      pages_for(sizeof(struct bcache_buf) * BCACHE_SECTORS));
+  uint8_t *data =
+      (uint8_t *)alloc_pages(pages_for(BCACHE_SECTORS * SECTOR_SIZE));
+
+  uint8_t *ra_data = (uint8_t *)alloc_pages(
+      pages_for(BCACHE_RA_SLOTS * BCACHE_RA_SECTORS * SECTOR_SIZE));
+  for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+    bcache_ras[i].count = 0;
+    bcache_ras[i].data = ra_data + i * BCACHE_RA_SECTORS * SECTOR_SIZE;
+  }
+
+  bcache_lru.lru_prev = bcache_lru.lru_next = &bcache_lru;
+  for (int i = 0; i < BCACHE_SECTORS; i++) {
+    struct bcache_buf *b = &bcache_bufs[i];
+    b->valid = false;
+    b->data = data + i * SECTOR_SIZE;
+    b->lru_next = bcache_lru.lru_next;
+    b->lru_prev = &bcache_lru;
+    bcache_lru.lru_next->lru_prev = b;
+    bcache_lru.lru_next = b;
+  }
+}
+
+static void lru_remove(struct bcache_buf *b) {
+  b->lru_prev->lru_next = b->lru_next;
+  b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(struct bcache_buf *b) {
+  b->lru_next = bcache_lru.lru_next;
+  b->lru_prev = &bcache_lru;
+  bcache_lru.lru_next->lru_prev = b;
+  bcache_lru.lru_next = b;
+}
+
+static void lru_push_back(struct bcache_buf *b) {
+  b->lru_prev = bcache_lru.lru_prev;
+  b->lru_next = &bcache_lru;
+  bcache_lru.lru_prev->lru_next = b;
+  bcache_lru.lru_prev = b;
+}
+
+static struct bcache_buf **hash_bucket(unsigned sector) {
+  return &bcache_hash[sector % BCACHE_HASH_SIZE];
+}
+
+static void hash_remove(struct bcache_buf *b) {
+  struct bcache_buf **p = hash_bucket(b->sector);
+  while (*p != b)
+    p = &(*p)->hash_next;
+  *p = b->hash_next;
+}
+
+static struct bcache_buf *find(unsigned sector) {
+  for (struct bcache_buf *b = *hash_bucket(sector); b; b = b->hash_next) {
+    if (b->sector == sector)
+      return b;
+  }
+  return NULL;
+}
+
+// sectorのバッファを探す。見つかればLRUの先頭に移す
+static struct bcache_buf *lookup(unsigned sector) {
+  struct bcache_buf *b = find(sector);
+  if (b) {
+    lru_remove(b);
+    lru_push_front(b);
+  }
+  return b;
+}
+
+// sectorのバッファを返す。なければ最も長く使われていないものを割り当てる。
+// ライトスルーなので、追い出すバッファを書き戻す必要はない
+static struct bcache_buf *get_buf(unsigned sector) {
+  struct bcache_buf *b = lookup(sector);
+  if (b)
+    return b;
+
+  b = bcache_lru.lru_prev;
+  if (b->valid)
+    hash_remove(b);
+  b->sector = sector;
+  b->valid = true;
+  struct bcache_buf **bucket = hash_bucket(sector);
+  b->hash_next = *bucket;
+  *bucket = b;
+  lru_remove(b);
+  lru_push_front(b);
+  return b;
+}
+
+static void invalidate(unsigned sector) {
+  struct bcache_buf *b = lookup(sector);
+  if (!b)
+    return;
+  hash_remove(b);
+  b->valid = false;
+  lru_remove(b);
+  lru_push_back(b);
+}
+
+static bool ra_overlaps(const struct bcache_ra *ra, unsigned sector,
+                        unsigned count) {
+  return ra->count > 0 && sector < ra->sector + ra->count &&
+         ra->sector < sector + count;
+}
+
+// 先読みの完了を待ち、読んだセクタをキャッシュに入れる。
+// その間に書き込まれてキャッシュにあるセクタはそちらが新しいので上書きしない
+static void ra_complete(struct bcache_ra *ra) {
+  if (virtio_blk_wait(&ra->io) == 0 && !ra->stale) {
+    for (unsigned i = 0; i < ra->count; i++) {
+      if (!find(ra->sector + i))
+        memcpy(get_buf(ra->sector + i)->data, ra->data + i * SECTOR_SIZE,
+               SECTOR_SIZE);
+    }
+  }
+  ra->count = 0;
+}
+
+// 範囲に重なる先読みを、読み込みなら完了させ、書き込みなら無効にする
+static void ra_sync_range(unsigned sector, unsigned count, bool is_write) {
+  for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+    struct bcache_ra *ra = &bcache_ras[i];
+    if (!ra_overlaps(ra, sector, count))
+      continue;
+    if (is_write)
+      ra->stale = true;
+    else
+      ra_complete(ra);
+  }
+}
+
+static bool ra_in_flight(unsigned sector) {
+  for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+    if (ra_overlaps(&bcache_ras[i], sector, 1))
+      return true;
+  }
+  return false;
+}
+
+// キャッシュにないセクタの読み込みを発行だけしておく。完了したものは
+// 次の読み込みか先読みのときにキャッシュに入る。空きスロットがなければ諦める
+void bcache_readahead(unsigned sector, unsigned count) {
+  virtio_blk_poll();
+  for (int i = 0; i < BCACHE_RA_SLOTS; i++) {
+    if (bcache_ras[i].count > 0 && bcache_ras[i].io.done)
+      ra_complete(&bcache_ras[i]);
+  }
+
+  while (count > 0) {
+    if (find(sector) || ra_in_flight(sector)) {
+      sector++;
+      count--;
+      continue;
+    }
+
+    unsigned n = 1;
+    while (n < count && n < BCACHE_RA_SECTORS && !find(sector + n) &&
+           !ra_in_flight(sector + n))
+      n++;
+
+    struct bcache_ra *ra = NULL;
+    for (int i = 0; i < BCACHE_RA_SLOTS && !ra; i++) {
+      if (bcache_ras[i].count == 0)
+        ra = &bcache_ras[i];
+    }
+    if (!ra)
+      return;
+
+    ra->sector = sector;
+    ra->count = n;
+    ra->stale = false;
+    if (blk_submit_read(&ra->io, ra->data, sector, n) < 0) {
+      ra->count = 0;
+      return;
+    }
+    sector += n;
+    count -= n;
+  }
+}
+
+// countセクタを読む。キャッシュにないセクタは連続する範囲ごとにまとめて
+// 並行に読み込み、読み終えたものをキャッシュに入れる
+int bcache_read(void *buf, unsigned sector, unsigned count) {
+  // 先読み中のセクタは、その完了を待ってキャッシュから読む
+  ra_sync_range(sector, count, false);
+
+  uint8_t *dst = buf;
+  struct virtio_blk_io ios[VIRTIO_BLK_REQ_MAX];
+  unsigned issued = 0;
+  int ret = 0;
+
+  for (unsigned i = 0; i < count;) {
+    struct bcache_buf *b = lookup(sector + i);
+    if (b) {
+      memcpy(dst + i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+      i++;
+      continue;
+    }
+
+    unsigned n = 1;
+    while (i + n < count && n < VIRTIO_BLK_MAX_SECTORS &&
+           !lookup(sector + i + n))
+      n++;
+
+    // 同時に発行できる数を超えたら、古いものから完了を待って使い回す
+    struct virtio_blk_io *io = &ios[issued % VIRTIO_BLK_REQ_MAX];
+    if (issued >= VIRTIO_BLK_REQ_MAX && virtio_blk_wait(io) < 0)
+      ret = -1;
+    blk_submit_read(io, dst + i * SECTOR_SIZE, sector + i, n);
+    issued++;
+    i += n;
+  }
+
+  unsigned n = issued < VIRTIO_BLK_REQ_MAX ? issued : VIRTIO_BLK_REQ_MAX;
+  for (unsigned i = 0; i < n; i++) {
+    if (virtio_blk_wait(&ios[i]) < 0)
+      ret = -1;
+  }
+  if (ret < 0)
+    return -1;
+
+  // 読み込んだセクタをキャッシュに入れる (ヒットしたものはLRUの先頭に移る)
+  for (unsigned i = 0; i < count; i++)
+    memcpy(get_buf(sector + i)->data, dst + i * SECTOR_SIZE, SECTOR_SIZE);
+  return 0;
+}
+
+int bcache_write(const void *buf, unsigned sector, unsigned count) {
+  ra_sync_range(sector, count, true);
+  const uint8_t *src = buf;
+  for (unsigned i = 0; i < count; i++)
+    memcpy(get_buf(sector + i)->data, src + i * SECTOR_SIZE, SECTOR_SIZE);
+  return blk_write(buf, sector, count);
+}
+
+// キャッシュにあるセクタは0で埋め、ないものはキャッシュに入れない
+int bcache_write_zeroes(unsigned sector, unsigned count) {
+  ra_sync_range(sector, count, true);
+  for (unsigned i = 0; i < count; i++) {
+    struct bcache_buf *b = lookup(sector + i);
+    if (b)
+      memset(b->data, 0, SECTOR_SIZE);
+  }
+  return blk_write_zeroes(sector, count);
+}
+
+// DISCARDしたセクタの内容は不定になるので、キャッシュから捨てる
+int bcache_discard(unsigned sector, unsigned count) {
+  ra_sync_range(sector, count, true);
+  for (unsigned i = 0; i < count; i++)
+    invalidate(sector + i);
+  return blk_discard(sector, count);
+}
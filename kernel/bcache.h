@@ -0,0 +1,25 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+// セクタ単位のバッファキャッシュ。ファイルシステムの読み書きはすべてここを通す。
+// 書き込みはキャッシュを更新してからブロックI/Oのキューに積む (ライトスルー)
+
+#include "kernel_defs.h"
+#include "virtio.h"
+
+// キャッシュするセクタ数 (alloc_pagesで確保する)
+#ifndef BCACHE_SECTORS
+#define BCACHE_SECTORS 1024
+#endif
+#define BCACHE_HASH_SIZE 256
+// 同時に発行できる先読みリクエストの数と、1リクエストのセクタ数
+#define BCACHE_RA_SLOTS 4
+#define BCACHE_RA_SECTORS VIRTIO_BLK_MAX_SECTORS
+
+void bcache_init(void);
+int bcache_read(void *buf, unsigned sector, unsigned count);
+int bcache_write(const void *buf, unsigned sector, unsigned count);
+int bcache_write_zeroes(unsigned sector, unsigned count);
+int bcache_discard(unsigned sector, unsigned count);
+void bcache_readahead(unsigned sector, unsigned count);
+
+#endif
@@ -0,0 +1,249 @@
+#include "blk.h"
+#include "kernel.h"
+
+// キューに溜まっている書き込み。dataはキューのバッファ内を指す
+struct blk_extent {
+  unsigned sector;
+  unsigned count;
+  uint8_t *data;
+};
+
+static struct blk_extent blk_extents[BLK_QUEUE_EXTENTS];
+static int blk_extent_count;
+static uint8_t *blk_queue_buf; // BLK_QUEUE_SECTORS分 (デバイスに直接渡せる)
+static unsigned blk_queue_used; // 使用済みのセクタ数
+static int blk_plug_depth;
+// 最後のblk_sync以降にデバイスへ書き込んだか
+static bool blk_unsynced;
+
+void blk_init(void) {
+  paddr_t paddr = alloc_pages(
+      align_up(BLK_QUEUE_SECTORS * SECTOR_SIZE, PAGE_SIZE) / PAGE_SIZE);
+  blk_queue_buf = (uint8_t *)paddr;
+}
+
+// sectorを含む書き込みがキューにあれば返す
+static struct blk_extent *find_extent(unsigned sector) {
+  for (int i = 0; i < blk_extent_count; i++) {
+    struct blk_extent *e = &blk_extents[i];
+    if (sector >= e->sector && sector < e->sector + e->count)
+      return e;
+  }
+  return NULL;
+}
+
+static bool overlaps_queue(unsigned sector, unsigned count) {
+  for (int i = 0; i < blk_extent_count; i++) {
+    struct blk_extent *e = &blk_extents[i];
+    if (sector < e->sector + e->count && e->sector < sector + count)
+      return true;
+  }
+  return false;
+}
+
+static void sort_extents(void) {
+  for (int i = 1; i < blk_extent_count; i++) {
+    struct blk_extent e = blk_extents[i];
+    int j = i - 1;
+    while (j >= 0 && blk_extents[j].sector > e.sector) {
+      blk_extents[j + 1] = blk_extents[j];
+      j--;
+    }
+    blk_extents[j + 1] = e;
+  }
+}
+
+// 溜まっている書き込みをセクタ順に発行し、すべての完了を待つ。
+// 隣接する書き込みは、セグメントを並べて1リクエストにまとめる
+int blk_flush(void) {
+  if (blk_extent_count == 0)
+    return 0;
+
+  sort_extents();
+
+  struct virtio_blk_io ios[VIRTIO_BLK_REQ_MAX];
+  unsigned issued = 0;
+  int ret = 0;
+  int i = 0;
+  unsigned offset = 0; // blk_extents[i]のうち発行済みのセクタ数
+  virtio_blk_plug();
+  while (i < blk_extent_count) {
+    struct virtio_blk_seg segs[VIRTIO_BLK_SEG_MAX];
+    int nsegs = 0;
+    unsigned start = blk_extents[i].sector + offset;
+    unsigned count = 0;
+    while (i < blk_extent_count && nsegs < VIRTIO_BLK_SEG_MAX &&
+           count < VIRTIO_BLK_MAX_SECTORS &&
+           blk_extents[i].sector + offset == start + count) {
+      struct blk_extent *e = &blk_extents[i];
+      unsigned n = e->count - offset;
+      if (n > VIRTIO_BLK_MAX_SECTORS - count)
+        n = VIRTIO_BLK_MAX_SECTORS - count;
+      segs[nsegs].buf = e->data + offset * SECTOR_SIZE;
+      segs[nsegs].len = n * SECTOR_SIZE;
+      nsegs++;
+      count += n;
+      offset += n;
+      if (offset == e->count) {
+        i++;
+        offset = 0;
+      }
+    }
+
+    // 同時に発行できる数を超えたら、古いものから完了を待って使い回す
+    struct virtio_blk_io *io = &ios[issued % VIRTIO_BLK_REQ_MAX];
+    if (issued >= VIRTIO_BLK_REQ_MAX && virtio_blk_wait(io) < 0)
+      ret = -1;
+    virtio_blk_submit_sg(io, start, segs, nsegs, true);
+    issued++;
+  }
+  virtio_blk_unplug();
+
+  unsigned n = issued < VIRTIO_BLK_REQ_MAX ? issued : VIRTIO_BLK_REQ_MAX;
+  for (unsigned j = 0; j < n; j++) {
+    if (virtio_blk_wait(&ios[j]) < 0)
+      ret = -1;
+  }
+
+  blk_extent_count = 0;
+  blk_queue_used = 0;
+  blk_unsynced = true;
+  return ret;
+}
+
+// 溜まっている書き込みを発行し、デバイスの書き込みキャッシュを書き出す。
+// 戻った時点で、それまでの書き込みはすべて永続化されている
+int blk_sync(void) {
+  int ret = blk_flush();
+  if (!blk_unsynced)
+    return ret;
+  if (virtio_blk_flush() < 0)
+    ret = -1;
+  blk_unsynced = false;
+  return ret;
+}
+
+// plugしている間の書き込みは、unplugするまでデバイスに発行しない
+void blk_plug(void) { blk_plug_depth++; }
+
+int blk_unplug(void) {
+  if (--blk_plug_depth == 0)
+    return blk_flush();
+  return 0;
+}
+
+// countセクタの書き込みをキューに積む。データはキューにコピーするので、
+// bufはすぐに再利用してよい。キューにある同じセクタへの書き込みは
+// 新しい内容で置き換え、デバイスには1回だけ書く
+int blk_write(const void *buf, unsigned sector, unsigned count) {
+  const uint8_t *src = buf;
+  unsigned i = 0;
+  while (i < count) {
+    unsigned s = sector + i;
+    struct blk_extent *e = find_extent(s);
+    if (e) {
+      unsigned n = e->sector + e->count - s;
+      if (n > count - i)
+        n = count - i;
+      memcpy(e->data + (s - e->sector) * SECTOR_SIZE, src + i * SECTOR_SIZE,
+             n * SECTOR_SIZE);
+      i += n;
+      continue;
+    }
+
+    // キューのどの書き込みとも重ならない範囲を新しく積む
+    unsigned n = 1;
+    while (i + n < count && !find_extent(s + n))
+      n++;
+
+    // 直前に積んだ範囲の続きなら、その範囲を延ばす
+    struct blk_extent *last =
+        blk_extent_count > 0 ? &blk_extents[blk_extent_count - 1] : NULL;
+    bool extend = last && last->sector + last->count == s &&
+                  last->data + last->count * SECTOR_SIZE ==
+                      blk_queue_buf + blk_queue_used * SECTOR_SIZE;
+
+    // キューがいっぱいなら、溜まっている分を先に書き出す
+    if (blk_queue_used == BLK_QUEUE_SECTORS ||
+        (!extend && blk_extent_count == BLK_QUEUE_EXTENTS)) {
+      if (blk_flush() < 0)
+        return -1;
+      continue;
+    }
+    if (n > BLK_QUEUE_SECTORS - blk_queue_used)
+      n = BLK_QUEUE_SECTORS - blk_queue_used;
+
+    uint8_t *data = blk_queue_buf + blk_queue_used * SECTOR_SIZE;
+    memcpy(data, src + i * SECTOR_SIZE, n * SECTOR_SIZE);
+    blk_queue_used += n;
+    if (extend) {
+      last->count += n;
+    } else {
+      blk_extents[blk_extent_count].sector = s;
+      blk_extents[blk_extent_count].count = n;
+      blk_extents[blk_extent_count].data = data;
+      blk_extent_count++;
+    }
+    i += n;
+  }
+
+  if (blk_plug_depth == 0)
+    return blk_flush();
+  return 0;
+}
+
+// 範囲を0で埋める。デバイスがWRITE_ZEROESに対応していればデータを転送せずに
+// 済ませ、そうでなければ0のページを書き込む
+int blk_write_zeroes(unsigned sector, unsigned count) {
+  // キューにある書き込みが後から上書きしないよう、先に書き出しておく
+  if (overlaps_queue(sector, count) && blk_flush() < 0)
+    return -1;
+  if (virtio_blk_write_zeroes(sector, count) == 0) {
+    blk_unsynced = true;
+    return 0;
+  }
+
+  static const uint8_t zero_page[PAGE_SIZE];
+  blk_plug();
+  for (unsigned i = 0; i < count; i += PAGE_SIZE / SECTOR_SIZE) {
+    unsigned n = count - i;
+    if (n > PAGE_SIZE / SECTOR_SIZE)
+      n = PAGE_SIZE / SECTOR_SIZE;
+    blk_write(zero_page, sector + i, n);
+  }
+  return blk_unplug();
+}
+
+// 使わなくなった範囲をデバイスに伝える。内容は不定になる
+int blk_discard(unsigned sector, unsigned count) {
+  if (overlaps_queue(sector, count) && blk_flush() < 0)
+    return -1;
+  return virtio_blk_discard(sector, count);
+}
+
+// キューにまだ書いていない範囲を読むときは、先に書き出してから読む
+int blk_read(void *buf, unsigned sector, unsigned count) {
+  if (overlaps_queue(sector, count) && blk_flush() < 0)
+    return -1;
+
+  for (unsigned i = 0; i < count; i += VIRTIO_BLK_MAX_SECTORS) {
+    unsigned n = count - i;
+    if (n > VIRTIO_BLK_MAX_SECTORS)
+      n = VIRTIO_BLK_MAX_SECTORS;
+    if (read_write_disk_range((uint8_t *)buf + i * SECTOR_SIZE, sector + i, n,
+                              false) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// 完了を待たずに読み込みを発行する (countはVIRTIO_BLK_MAX_SECTORS以下)
+int blk_submit_read(struct virtio_blk_io *io, void *buf, unsigned sector,
+                    unsigned count) {
+  if (overlaps_queue(sector, count) && blk_flush() < 0) {
+    io->status = VIRTIO_BLK_S_IOERR;
+    io->done = true;
+    return -1;
+  }
+  return virtio_blk_submit(io, buf, sector, count, false);
+}
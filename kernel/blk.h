@@ -0,0 +1,26 @@
+#ifndef BLK_H
+#define BLK_H
+// ファイルシステムとvirtio-blkの間に置くブロックI/Oのキュー。
+// plugしている間の書き込みはキューに溜め、unplugでセクタ順に並べ替え、
+// 隣接するものをまとめてデバイスに発行する
+
+#include "kernel_defs.h"
+#include "virtio.h"
+
+// キューに溜められるセクタ数と、書き込み範囲 (エクステント) の数
+#define BLK_QUEUE_SECTORS 128
+#define BLK_QUEUE_EXTENTS 32
+
+void blk_init(void);
+void blk_plug(void);
+int blk_unplug(void);
+int blk_flush(void);
+int blk_sync(void);
+int blk_write(const void *buf, unsigned sector, unsigned count);
+int blk_write_zeroes(unsigned sector, unsigned count);
+int blk_discard(unsigned sector, unsigned count);
+int blk_read(void *buf, unsigned sector, unsigned count);
+int blk_submit_read(struct virtio_blk_io *io, void *buf, unsigned sector,
+                    unsigned count);
+
+#endif
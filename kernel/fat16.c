@@ -1,5 +1,135 @@
 #include "fat16.h"
+#include "bcache.h"
+#include "blk.h"
 #include "virtio.h"
+#include "kernel.h"
+
+// 連続したセクタを読み書きする。どちらもバッファキャッシュを通す
+static void read_write_sectors(void *buf, unsigned sector, unsigned count,
+                               int is_write) {
+  if (is_write)
+    bcache_write(buf, sector, count);
+  else
+    bcache_read(buf, sector, count);
+}
+
+struct fat16_geometry fat16_geo;
+
+// RAM上のルートディレクトリ。FAT32ではクラスタを足すと後ろに伸びる
+struct dir_entry root_dir[ROOT_ENT_MAX];
+
+// 端数のクラスタを読み書きするときの一時バッファ (最大のクラスタサイズ)
+static uint8_t *cluster_buf;
+
+static void alloc_fat_tables(void);
+static void init_empty_fat(void);
+static inline uint32_t cluster_to_sector(uint32_t cluster);
+
+// BPBの値から各領域の位置とクラスタ数を求める
+static void set_geometry(uint32_t fat_type, uint32_t sec_per_clus,
+                         uint32_t rsvd_sec_cnt, uint32_t num_fats,
+                         uint32_t fat_size, uint32_t root_ent_cnt,
+                         uint32_t total_sectors) {
+  struct fat16_geometry *g = &fat16_geo;
+  g->fat_type = fat_type;
+  g->sec_per_clus = sec_per_clus;
+  g->rsvd_sec_cnt = rsvd_sec_cnt;
+  g->num_fats = num_fats;
+  g->fat_size = fat_size;
+  g->root_ent_cnt = root_ent_cnt;
+  g->fat_start = rsvd_sec_cnt;
+  g->root_dir_start = g->fat_start + num_fats * fat_size;
+  g->root_dir_sectors =
+      (root_ent_cnt * sizeof(struct dir_entry) + BPB_BytsPerSec - 1) /
+      BPB_BytsPerSec;
+  g->data_start = g->root_dir_start + g->root_dir_sectors;
+
+  // FATに入りきらないクラスタや、扱える上限を超えるクラスタは使わない。
+  // 切り詰めが起きるのはフォーマットのときだけ (マウントでは断る)
+  uint32_t clusters = 0;
+  if (total_sectors > g->data_start)
+    clusters = (total_sectors - g->data_start) / sec_per_clus;
+  uint32_t entry_size = fat_type == FAT_TYPE_32 ? 4 : 2;
+  uint32_t fat_capacity = fat_size * (BPB_BytsPerSec / entry_size) - 2;
+  uint32_t max = fat_type == FAT_TYPE_32 ? FAT32_CLUSTERS_MAX
+                                         : FAT16_CLUSTERS_MAX;
+  if (clusters > fat_capacity)
+    clusters = fat_capacity;
+  if (clusters > max)
+    clusters = max;
+  g->cluster_count = clusters;
+  g->total_sectors = total_sectors;
+
+  if (!cluster_buf)
+    cluster_buf = (uint8_t *)alloc_pages(
+        FAT16_SEC_PER_CLUS_MAX * BPB_BytsPerSec / PAGE_SIZE);
+}
+
+// sectorsセクタのディスクをフォーマットするときの配置を決める。
+// FAT16に収まる大きさならFAT16、それより大きければFAT32にする。
+// クラスタサイズはMicrosoftのFAT仕様にある容量ごとの表に従う
+static void choose_geometry(uint32_t sectors) {
+  uint32_t spc;
+  if (sectors > FAT16_FORMAT_SECTORS_MAX) {
+    if (sectors <= 16777216)
+      spc = 8;
+    else if (sectors <= 33554432)
+      spc = 16;
+    else if (sectors <= 67108864)
+      spc = 32;
+    else
+      spc = 64;
+    // RAM上のFATに収まるようにクラスタを大きくする
+    while (spc < FAT16_SEC_PER_CLUS_MAX &&
+           sectors / spc > FAT32_CLUSTERS_MAX)
+      spc *= 2;
+
+    uint32_t tmp1 = sectors - FAT32_RSVD_SEC_CNT;
+    uint32_t tmp2 = (256 * spc + BPB_NumFATs) / 2;
+    uint32_t fat_size = (tmp1 + tmp2 - 1) / tmp2;
+    set_geometry(FAT_TYPE_32, spc, FAT32_RSVD_SEC_CNT, BPB_NumFATs, fat_size,
+                 0, sectors);
+    // 上限で切り詰めたときは、使うクラスタの分だけのFATにする
+    uint32_t need = ((fat16_geo.cluster_count + 2) * 4 + BPB_BytsPerSec - 1) /
+                    BPB_BytsPerSec;
+    if (need < fat_size)
+      set_geometry(FAT_TYPE_32, spc, FAT32_RSVD_SEC_CNT, BPB_NumFATs, need, 0,
+                   sectors);
+    fat16_geo.root_cluster = 2;
+    fat16_geo.fsinfo_sector = FAT32_FSINFO_SECTOR;
+  } else {
+    if (sectors <= 8400)
+      spc = 1; // 本来はFAT12の大きさ
+    else if (sectors <= 32680)
+      spc = 2;
+    else if (sectors <= 262144)
+      spc = 4;
+    else if (sectors <= 524288)
+      spc = 8;
+    else if (sectors <= 1048576)
+      spc = 16;
+    else if (sectors <= 2097152)
+      spc = 32;
+    else
+      spc = 64;
+
+    // FATの大きさも仕様の計算式で求める
+    uint32_t root_dir_sectors =
+        (BPB_RootEntCnt * sizeof(struct dir_entry) + BPB_BytsPerSec - 1) /
+        BPB_BytsPerSec;
+    uint32_t tmp1 = sectors - (BPB_RsvdSecCnt + root_dir_sectors);
+    uint32_t tmp2 = 256 * spc + BPB_NumFATs;
+    uint32_t fat_size = (tmp1 + tmp2 - 1) / tmp2;
+    if (fat_size > FAT16_FAT_SECTORS_MAX)
+      fat_size = FAT16_FAT_SECTORS_MAX;
+    set_geometry(FAT_TYPE_16, spc, BPB_RsvdSecCnt, BPB_NumFATs, fat_size,
+                 BPB_RootEntCnt, sectors);
+  }
+
+  // 使えるクラスタの後ろに余ったセクタはボリュームに含めない
+  fat16_geo.total_sectors =
+      fat16_geo.data_start + fat16_geo.cluster_count * spc;
+}
 
 static void write_bpb_to_disk(void) {
   uint8_t buf[SECTOR_SIZE];
@@ -15,211 +145,823 @@ static void write_bpb_to_disk(void) {
   memcpy(bpb->OEMName, "KCSOS   ", 8);
 
   bpb->BytsPerSec = BPB_BytsPerSec;
-  bpb->SecPerClus = BPB_SecPerClus;
-  bpb->RsvdSecCnt = BPB_RsvdSecCnt;
-  bpb->NumFATs = BPB_NumFATs;
-  bpb->RootEntCnt = BPB_RootEntCnt;
-
-  bpb->TotSec16 = BPB_TotSec16;
+  bpb->SecPerClus = fat16_geo.sec_per_clus;
+  bpb->RsvdSecCnt = fat16_geo.rsvd_sec_cnt;
+  bpb->NumFATs = fat16_geo.num_fats;
+  bpb->RootEntCnt = fat16_geo.root_ent_cnt;
+
+  // 65536セクタ以上のボリュームはTotSec32に入れる
+  if (fat16_geo.fat_type == FAT_TYPE_16 && fat16_geo.total_sectors < 0x10000) {
+    bpb->TotSec16 = fat16_geo.total_sectors;
+    bpb->TotSec32 = 0;
+  } else {
+    bpb->TotSec16 = 0;
+    bpb->TotSec32 = fat16_geo.total_sectors;
+  }
   bpb->Media = 0xF8; // ハードディスク
-  bpb->FATSz16 = BPB_FATSz16;
   bpb->SecPerTrk = 32;
   bpb->NumHeads = 64;
-  bpb->HiddSec = 0;  // 隠しセクタ数
-  bpb->TotSec32 = 0; // TotSec16を参照
-
-  bpb->DrvNum = 0x80;  // 主ディスク
-  bpb->Reserved1 = 0;  // 予約領域
-  bpb->BootSig = 0x29; // 拡張ブートシグネチャ
-  bpb->VolID = rand(); // ボリュームシリアル番号
-  memcpy(bpb->VolLab, "KCS_OS     ", 11);
-  memcpy(bpb->FilSysType, "FAT16   ", 8);
+  bpb->HiddSec = 0; // 隠しセクタ数
+
+  if (fat16_geo.fat_type == FAT_TYPE_32) {
+    struct bpb_fat32 *bpb32 = (struct bpb_fat32 *)buf;
+    bpb32->jmpBoot[1] = 0x58;
+    bpb32->RootEntCnt = 0;
+    bpb32->FATSz16 = 0;
+    bpb32->FATSz32 = fat16_geo.fat_size;
+    bpb32->ExtFlags = 0; // すべてのFATをミラーする
+    bpb32->FSVer = 0;
+    bpb32->RootClus = fat16_geo.root_cluster;
+    bpb32->FSInfo = fat16_geo.fsinfo_sector;
+    bpb32->BkBootSec = FAT32_BACKUP_BOOT_SECTOR;
+    bpb32->DrvNum = 0x80;
+    bpb32->BootSig = 0x29;
+    bpb32->VolID = rand();
+    memcpy(bpb32->VolLab, "KCS_OS     ", 11);
+    memcpy(bpb32->FilSysType, "FAT32   ", 8);
+  } else {
+    bpb->FATSz16 = fat16_geo.fat_size;
+    bpb->DrvNum = 0x80;  // 主ディスク
+    bpb->Reserved1 = 0;  // 予約領域
+    bpb->BootSig = 0x29; // 拡張ブートシグネチャ
+    bpb->VolID = rand(); // ボリュームシリアル番号
+    memcpy(bpb->VolLab, "KCS_OS     ", 11);
+    memcpy(bpb->FilSysType, "FAT16   ", 8);
+  }
 
   // 末尾シグネチャ
   buf[510] = 0x55;
   buf[511] = 0xAA;
 
-  // セクタ0に書き込み
-  read_write_disk(buf, 0, true);
+  // セクタ0に書き込み。FAT32ではバックアップも置く
+  bcache_write(buf, 0, 1);
+  if (fat16_geo.fat_type == FAT_TYPE_32)
+    bcache_write(buf, FAT32_BACKUP_BOOT_SECTOR, 1);
 }
 
+static void write_fsinfo_to_disk(void);
+
 void init_fat16_disk(void) {
-  uint8_t buf[SECTOR_SIZE];
+  // ディスクの容量に合わせて配置を決める
+  uint64_t sectors = blk_capacity / SECTOR_SIZE;
+  choose_geometry(sectors > 0xFFFFFFFF ? 0xFFFFFFFF : sectors);
+  alloc_fat_tables();
+
+  blk_plug();
+
+  // 予約領域、FAT、ルートディレクトリ領域 (連続している) を0埋めする。
+  // WRITE_ZEROESに対応していれば1リクエストで済む
+  bcache_write_zeroes(1, DATA_START_SECTOR - 1);
+
+  // RAM上のFATとルートディレクトリを空の状態から作る。
+  // 以降はこちらを正とする
+  init_empty_fat();
+  set_fat_entry(0, 0x0FFFFFF8); // media + reserved bits
+  set_fat_entry(1, FAT_EOC);    // reserved
+  if (fat16_geo.fat_type == FAT_TYPE_32) {
+    // ルートディレクトリは最初のクラスタに置く
+    alloc_cluster_chain(0, 1);
+    bcache_write_zeroes(cluster_to_sector(fat16_geo.root_cluster),
+                        fat16_geo.sec_per_clus);
+  }
+  read_root_dir_from_disk();
 
-  // ブートセクタを書き込む
+  // ブートセクタとFSInfoを書き込む
   write_bpb_to_disk();
+  if (fat16_geo.fat_type == FAT_TYPE_32)
+    write_fsinfo_to_disk();
 
-  for (int i = 0; i < SECTOR_SIZE; i++)
-    buf[i] = 0;
+  blk_unplug();
+
+  // FAT2も含めてフォーマットした状態を永続化する
+  fat16_sync();
+
+  printf("[FAT%d] formatted: ", (int)fat16_geo.fat_type);
+  printf("%d clusters of ", (int)fat16_geo.cluster_count);
+  printf("%d bytes\n", (int)CLUSTER_SIZE);
+}
+
+// セクタ0のBPBを調べ、このドライバで扱えるFAT16/FAT32ボリュームなら配置を
+// 設定してFATとルートディレクトリを読み込む。FATボリュームが見つからなければ
+// FAT_MOUNT_NONEを、FATのブートセクタはあるがこのドライバで扱えない
+// ボリュームならFAT_MOUNT_UNSUPPORTEDを返す
+int fat16_mount(void) {
+  uint8_t buf[SECTOR_SIZE];
+  if (bcache_read(buf, 0, 1) < 0)
+    return FAT_MOUNT_NONE;
+
+  struct bpb_fat16 *bpb = (struct bpb_fat16 *)buf;
+  struct bpb_fat32 *bpb32 = (struct bpb_fat32 *)buf;
+  if (buf[510] != 0x55 || buf[511] != 0xAA ||
+      (bpb->jmpBoot[0] != 0xEB && bpb->jmpBoot[0] != 0xE9)) {
+    printf("[FAT] no boot signature\n");
+    return FAT_MOUNT_NONE;
+  }
 
-  // FATエントリを0埋め
-  for (unsigned s = FAT1_START_SECTOR;
-       s < FAT1_START_SECTOR + BPB_FATSz16 * BPB_NumFATs; s++) {
-    read_write_disk(buf, s, true);
+  uint32_t spc = bpb->SecPerClus;
+  uint32_t rsvd = bpb->RsvdSecCnt;
+  uint32_t fat_size = bpb->FATSz16 ? bpb->FATSz16 : bpb32->FATSz32;
+  uint32_t total = bpb->TotSec16 ? bpb->TotSec16 : bpb->TotSec32;
+  if (bpb->BytsPerSec != BPB_BytsPerSec || spc == 0 ||
+      spc > FAT16_SEC_PER_CLUS_MAX || (spc & (spc - 1)) != 0 || rsvd == 0 ||
+      bpb->NumFATs == 0 || bpb->RootEntCnt % 16 != 0 || fat_size == 0 ||
+      fat_size > total / bpb->NumFATs ||
+      total > blk_capacity / SECTOR_SIZE) {
+    // ブートセクタの署名はあるので、フォーマットせずに扱えないものとする
+    printf("[FAT] unsupported volume geometry\n");
+    return FAT_MOUNT_UNSUPPORTED;
+  }
+
+  // FATの種類はデータ領域のクラスタ数で決まる
+  uint32_t root_dir_sectors =
+      (bpb->RootEntCnt * sizeof(struct dir_entry) + BPB_BytsPerSec - 1) /
+      BPB_BytsPerSec;
+  uint32_t data_start = rsvd + bpb->NumFATs * fat_size + root_dir_sectors;
+  if (total <= data_start) {
+    printf("[FAT] unsupported volume geometry\n");
+    return FAT_MOUNT_UNSUPPORTED;
+  }
+  uint32_t clusters = (total - data_start) / spc;
+
+  // 既存のボリュームのクラスタを切り詰めると、その先に続くチェーンが途中で
+  // 終わって見え、データを失う。FATに入りきらないものや上限を超えるものは
+  // マウントしない (切り詰めはフォーマットのときだけ)
+  uint32_t per_sector = BPB_BytsPerSec / (clusters >= 65525 ? 4 : 2);
+  if (clusters > FAT32_CLUSTERS_MAX ||
+      (clusters + 2 + per_sector - 1) / per_sector > fat_size) {
+    printf("[FAT] too many clusters for this driver\n");
+    return FAT_MOUNT_UNSUPPORTED;
   }
 
-  // ルートディレクトリ領域を0埋め
-  for (unsigned s = ROOT_DIR_START_SECTOR;
-       s < ROOT_DIR_START_SECTOR + ROOT_DIR_SECTORS; s++) {
-    read_write_disk(buf, s, true);
+  if (clusters >= 65525) {
+    if (bpb->RootEntCnt != 0 || bpb->FATSz16 != 0 || bpb32->FSVer != 0 ||
+        bpb32->RootClus < 2 || (bpb32->ExtFlags & 0x80)) {
+      printf("[FAT32] unsupported volume\n");
+      return FAT_MOUNT_UNSUPPORTED;
+    }
+    set_geometry(FAT_TYPE_32, spc, rsvd, bpb->NumFATs, fat_size, 0, total);
+    fat16_geo.root_cluster = bpb32->RootClus;
+    // FSInfoは予約領域の中にあるときだけ使う。0や0xFFFFは「FSInfoなし」
+    fat16_geo.fsinfo_sector =
+        bpb32->FSInfo >= 1 && bpb32->FSInfo < rsvd ? bpb32->FSInfo : 0;
+    if (!fat_cluster_valid(fat16_geo.root_cluster)) {
+      printf("[FAT32] root directory beyond usable clusters\n");
+      return FAT_MOUNT_UNSUPPORTED;
+    }
+  } else {
+    // クラスタ数の少ないボリュームはFAT12なので、FAT16と明示されたものに限る
+    if (clusters < 4085 &&
+        strncmp((const char *)bpb->FilSysType, "FAT16   ", 8) != 0) {
+      printf("[FAT16] not a FAT16 volume\n");
+      return FAT_MOUNT_UNSUPPORTED;
+    }
+    if (bpb->RootEntCnt == 0 || bpb->RootEntCnt > ROOT_ENT_MAX ||
+        bpb->FATSz16 == 0 || bpb->FATSz16 > FAT16_FAT_SECTORS_MAX) {
+      printf("[FAT16] unsupported volume geometry\n");
+      return FAT_MOUNT_UNSUPPORTED;
+    }
+    set_geometry(FAT_TYPE_16, spc, rsvd, bpb->NumFATs, fat_size,
+                 bpb->RootEntCnt, total);
   }
+  alloc_fat_tables();
 
-  // FAT の予約エントリ (0,1) を埋めておく
   read_fat_from_disk();
-  fat[0] = 0xFFF8; // media + reserved bits
-  fat[1] = 0xFFFF; // reserved
-  write_fat_to_disk();
+  if ((get_fat_entry(0) & 0xFF) != bpb->Media) {
+    printf("[FAT] media byte mismatch\n");
+    return FAT_MOUNT_UNSUPPORTED;
+  }
+  read_root_dir_from_disk();
+  return 0;
 }
 
-// RAM上のFATとルートディレクトリ
-uint16_t fat[FAT_ENTRY_NUM];
-struct dir_entry root_dir[BPB_RootEntCnt];
-
 // データ領域の読み書き
-static inline uint32_t cluster_to_sector(uint16_t cluster) {
-  return DATA_START_SECTOR + (cluster - 2) * BPB_SecPerClus;
+static inline uint32_t cluster_to_sector(uint32_t cluster) {
+  return DATA_START_SECTOR + (cluster - 2) * fat16_geo.sec_per_clus;
+}
+
+void read_cluster(uint32_t cluster, void *buf) {
+  bcache_read(buf, cluster_to_sector(cluster), fat16_geo.sec_per_clus);
+}
+
+void write_cluster(uint32_t cluster, const void *buf) {
+  bcache_write(buf, cluster_to_sector(cluster), fat16_geo.sec_per_clus);
+}
+
+// clusterから連続するcount個のクラスタを読む
+int read_clusters(uint32_t cluster, unsigned count, void *buf) {
+  return bcache_read(buf, cluster_to_sector(cluster),
+                     count * fat16_geo.sec_per_clus);
+}
+
+// clusterから連続するcount個のクラスタを0で埋める
+void zero_clusters(uint32_t cluster, unsigned count) {
+  bcache_write_zeroes(cluster_to_sector(cluster),
+                      count * fat16_geo.sec_per_clus);
 }
 
-void read_cluster(uint16_t cluster, void *buf) {
-  for (int i = 0; i < BPB_SecPerClus; i++) {
-    read_write_disk((uint8_t *)buf + i * BPB_BytsPerSec,
-                    cluster_to_sector(cluster) + i, 0);
+// clusterの先頭にdataのlenバイトを書き、残りを0で埋める。
+// dataがNULLならクラスタ全体を0にする
+static void put_cluster(uint32_t cluster, const uint8_t *data, uint32_t len) {
+  if (!data) {
+    bcache_write_zeroes(cluster_to_sector(cluster), fat16_geo.sec_per_clus);
+  } else if (len == CLUSTER_SIZE) {
+    write_cluster(cluster, data);
+  } else {
+    memcpy(cluster_buf, data, len);
+    memset(cluster_buf + len, 0, CLUSTER_SIZE - len);
+    write_cluster(cluster, cluster_buf);
   }
 }
 
-void write_cluster(uint16_t cluster, void *buf) {
-  for (int i = 0; i < BPB_SecPerClus; i++) {
-    read_write_disk((uint8_t *)buf + i * BPB_BytsPerSec,
-                    cluster_to_sector(cluster) + i, 1);
+// セクタ単位の変更フラグ (ビットマップ) の操作
+static inline void set_bit(uint32_t *bits, unsigned i) {
+  bits[i / 32] |= 1u << (i % 32);
+}
+
+static inline void clear_bit(uint32_t *bits, unsigned i) {
+  bits[i / 32] &= ~(1u << (i % 32));
+}
+
+static inline bool test_bit(const uint32_t *bits, unsigned i) {
+  return (bits[i / 32] & (1u << (i % 32))) != 0;
+}
+
+// bitsが立っている連続したセクタを、baseからstart_sector以降の領域に
+// 書き込む。同じビットマップで複数の領域 (FATのコピー) に書けるように、
+// ビットは呼び出し側で落とす
+static void write_dirty_sectors(const void *base, const uint32_t *bits,
+                                unsigned nsectors, unsigned start_sector) {
+  for (unsigned i = 0; i < nsectors;) {
+    if (!test_bit(bits, i)) {
+      i++;
+      continue;
+    }
+    unsigned n = 1;
+    while (i + n < nsectors && test_bit(bits, i + n))
+      n++;
+    bcache_write((const uint8_t *)base + i * BPB_BytsPerSec,
+                 start_sector + i, n);
+    i += n;
   }
 }
 
 // ルートディレクトリの読み書き
+// マウント後はRAM上のroot_dir[]が正で、変更したエントリを含むセクタだけを
+// 書き戻す
+#define ROOT_DIR_SECTORS_MAX                                                   \
+  (ROOT_ENT_MAX * sizeof(struct dir_entry) / BPB_BytsPerSec)
+static uint32_t root_dir_dirty[(ROOT_DIR_SECTORS_MAX + 31) / 32];
+
+// FAT32のルートディレクトリを構成するクラスタ (チェーンの順)
+static uint32_t root_clusters[ROOT_DIR_SECTORS_MAX];
+static unsigned root_cluster_count;
+
+// 8.3形式の名前 (11バイト) をキーにしたroot_dirのハッシュ索引と、
+// 空きエントリのリスト。どちらもentry番号をdir_nextでつなぐ。
+// 空きリストは番号の小さい順に並べ、0x00 (以降は空き) の意味を保つ
+#define DIR_HASH_SIZE 128
+static int dir_hash[DIR_HASH_SIZE];
+static int dir_next[ROOT_ENT_MAX];
+static int dir_free_head;
+
+// パスを8.3形式の名前 (11バイト) に詰める。名前が8文字、拡張子が3文字を
+// 超えるものや、空の名前・拡張子は切り詰めずに-1を返す。切り詰めると
+// 別のファイルの名前と一致してしまう
+static int pack_83_name(const char *path, char packed[11]) {
+  memset(packed, ' ', 11);
+  int n = 0;
+  while (path[n] && path[n] != '.') {
+    if (n >= 8)
+      return -1;
+    packed[n] = path[n];
+    n++;
+  }
+  if (n == 0)
+    return -1;
+  if (path[n] == '.') {
+    n++;
+    int e = 0;
+    while (path[n + e]) {
+      if (e >= 3 || path[n + e] == '.')
+        return -1;
+      packed[8 + e] = path[n + e];
+      e++;
+    }
+    if (e == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// nameとextは連続しているので、dir_entryのnameもそのまま渡せる
+static unsigned dir_name_hash(const char *packed) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (int i = 0; i < 11; i++)
+    h = (h ^ (uint8_t)packed[i]) * 16777619u;
+  return h % DIR_HASH_SIZE;
+}
+
+static void dir_index_insert(int index) {
+  unsigned h = dir_name_hash(root_dir[index].name);
+  dir_next[index] = dir_hash[h];
+  dir_hash[h] = index;
+}
+
+static void build_dir_index(void) {
+  for (int i = 0; i < DIR_HASH_SIZE; i++)
+    dir_hash[i] = -1;
+
+  bool end = false;
+  int *free_tail = &dir_free_head;
+  for (int i = 0; i < (int)fat16_geo.root_ent_cnt; i++) {
+    if (root_dir[i].name[0] == 0x00)
+      end = true;
+    if (end || root_dir[i].name[0] == 0xE5) {
+      *free_tail = i;
+      free_tail = &dir_next[i];
+    } else {
+      dir_index_insert(i);
+    }
+  }
+  *free_tail = -1;
+}
+
+struct dir_entry *find_dir_entry_by_path(const char *path) {
+  char packed[11];
+  if (pack_83_name(path, packed) < 0)
+    return NULL;
+  for (int i = dir_hash[dir_name_hash(packed)]; i >= 0; i = dir_next[i]) {
+    if (strncmp(root_dir[i].name, packed, 11) == 0)
+      return &root_dir[i];
+  }
+  return NULL;
+}
+
+// ルートディレクトリのk番目のセクタのディスク上の位置
+static uint32_t root_dir_sector(unsigned k) {
+  if (fat16_geo.fat_type == FAT_TYPE_16)
+    return ROOT_DIR_START_SECTOR + k;
+  unsigned spc = fat16_geo.sec_per_clus;
+  return cluster_to_sector(root_clusters[k / spc]) + k % spc;
+}
+
 void read_root_dir_from_disk(void) {
-  for (int i = 0; i < ROOT_DIR_SECTORS; i++) {
-    read_write_disk(&root_dir[i * (BPB_BytsPerSec / 32)],
-                    ROOT_DIR_START_SECTOR + i, 0);
+  if (fat16_geo.fat_type == FAT_TYPE_16) {
+    read_write_sectors(root_dir, ROOT_DIR_START_SECTOR, ROOT_DIR_SECTORS, 0);
+  } else {
+    // FAT32のルートディレクトリはクラスタチェーン。RAMに入る分だけ読む
+    unsigned max = ROOT_ENT_MAX * sizeof(struct dir_entry) / CLUSTER_SIZE;
+    root_cluster_count = 0;
+    for (uint32_t c = fat16_geo.root_cluster;
+         fat_cluster_valid(c) && root_cluster_count < max;
+         c = get_fat_entry(c)) {
+      read_cluster(c, (uint8_t *)root_dir + root_cluster_count * CLUSTER_SIZE);
+      root_clusters[root_cluster_count++] = c;
+    }
+    fat16_geo.root_ent_cnt =
+        root_cluster_count * CLUSTER_SIZE / sizeof(struct dir_entry);
   }
+  memset(root_dir_dirty, 0, sizeof(root_dir_dirty));
+  build_dir_index();
+}
+
+void mark_dir_entry_dirty(const struct dir_entry *de) {
+  set_bit(root_dir_dirty,
+          (unsigned)(de - root_dir) * sizeof(struct dir_entry) /
+              BPB_BytsPerSec);
 }
 
 void write_root_dir_to_disk(void) {
-  for (int i = 0; i < ROOT_DIR_SECTORS; i++) {
-    read_write_disk(&root_dir[i * (BPB_BytsPerSec / 32)],
-                    ROOT_DIR_START_SECTOR + i, 1);
+  if (fat16_geo.fat_type == FAT_TYPE_16) {
+    write_dirty_sectors(root_dir, root_dir_dirty, ROOT_DIR_SECTORS,
+                        ROOT_DIR_START_SECTOR);
+    memset(root_dir_dirty, 0, sizeof(root_dir_dirty));
+    return;
+  }
+
+  // FAT32ではディスク上で連続している範囲ごとに書き込む
+  unsigned nsectors =
+      fat16_geo.root_ent_cnt * sizeof(struct dir_entry) / BPB_BytsPerSec;
+  for (unsigned i = 0; i < nsectors;) {
+    if (!test_bit(root_dir_dirty, i)) {
+      i++;
+      continue;
+    }
+    unsigned n = 1;
+    while (i + n < nsectors && test_bit(root_dir_dirty, i + n) &&
+           root_dir_sector(i + n) == root_dir_sector(i) + n)
+      n++;
+    bcache_write((const uint8_t *)root_dir + i * BPB_BytsPerSec,
+                 root_dir_sector(i), n);
+    for (unsigned j = i; j < i + n; j++)
+      clear_bit(root_dir_dirty, j);
+    i += n;
   }
 }
 
+// FAT32のルートディレクトリにクラスタを1つ足し、増えたエントリを空きリストに
+// つなぐ。空きリストが空のときだけ呼ぶので、番号の順序は保たれる
+static int grow_root_dir(void) {
+  unsigned per_cluster = CLUSTER_SIZE / sizeof(struct dir_entry);
+  if (fat16_geo.fat_type != FAT_TYPE_32 || root_cluster_count == 0 ||
+      fat16_geo.root_ent_cnt + per_cluster > ROOT_ENT_MAX)
+    return -1;
+
+  uint32_t c = alloc_cluster_chain(root_clusters[root_cluster_count - 1], 1);
+  if (c == 0)
+    return -1;
+  bcache_write_zeroes(cluster_to_sector(c), fat16_geo.sec_per_clus);
+  root_clusters[root_cluster_count++] = c;
+
+  unsigned first = fat16_geo.root_ent_cnt;
+  memset(&root_dir[first], 0, CLUSTER_SIZE);
+  fat16_geo.root_ent_cnt += per_cluster;
+  for (unsigned i = first; i < fat16_geo.root_ent_cnt; i++)
+    dir_next[i] = i + 1 < fat16_geo.root_ent_cnt ? (int)i + 1 : -1;
+  dir_free_head = first;
+  return 0;
+}
+
 // FAT領域の読み書き
+// マウント後はRAM上のFATが正で、ディスクには変更したセクタだけを書き戻す。
+// fat_dirtyはFAT1に未反映のセクタ、fat_mirror_dirtyはFAT2以降に未反映のセクタ。
+// FAT32ではFATが大きいので、マウント時には読まずにFAT_LOAD_SECTORSずつ
+// 必要になったところだけ読み込む (fat_loaded)
+#define FAT_LOAD_SECTORS VIRTIO_BLK_MAX_SECTORS
+#define FAT_ENTRY_SIZE (fat16_geo.fat_type == FAT_TYPE_32 ? 4u : 2u)
+#define FAT_ENTRIES_PER_SECTOR (BPB_BytsPerSec / FAT_ENTRY_SIZE)
+
+static void *fat_table;
+static uint32_t fat_sectors; // 使うクラスタのエントリを含むFATのセクタ数
+static uint32_t *fat_loaded;
+static uint32_t *fat_dirty;
+static uint32_t *fat_mirror_dirty;
+static uint32_t fat_alloc_pages;
+
+// 空きクラスタのビットマップと数。FATを読み込んだ範囲について作り、
+// set_fat_entryで更新する。alloc_hintは次に空きを探し始める位置 (next-fit)。
+// FAT32では空きの数と位置をFSInfoから得るので、マウント時にFATを走査しない
+static uint32_t *free_bitmap;
+static uint32_t free_clusters;
+static uint32_t alloc_hint = 2;
+static bool fsinfo_dirty;
+
+static inline uint32_t words_for(uint32_t bits) { return (bits + 31) / 32; }
+
+// 今の配置に合わせてRAM上のFATとビットマップの領域を用意する。
+// 足りるなら前に確保した領域を使い回す
+static void alloc_fat_tables(void) {
+  fat_sectors = (FAT_ENTRY_NUM * FAT_ENTRY_SIZE + BPB_BytsPerSec - 1) /
+                BPB_BytsPerSec;
+  uint32_t chunks = (fat_sectors + FAT_LOAD_SECTORS - 1) / FAT_LOAD_SECTORS;
+  uint32_t bytes = fat_sectors * BPB_BytsPerSec +
+                   4 * (words_for(chunks) + 2 * words_for(fat_sectors) +
+                        words_for(FAT_ENTRY_NUM));
+  uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (pages > fat_alloc_pages) {
+    fat_table = (void *)alloc_pages(pages);
+    fat_alloc_pages = pages;
+  }
+
+  uint32_t *p =
+      (uint32_t *)((uint8_t *)fat_table + fat_sectors * BPB_BytsPerSec);
+  fat_loaded = p;
+  p += words_for(chunks);
+  fat_dirty = p;
+  p += words_for(fat_sectors);
+  fat_mirror_dirty = p;
+  p += words_for(fat_sectors);
+  free_bitmap = p;
+}
+
+static inline uint32_t fat_raw_entry(uint32_t cluster) {
+  if (fat16_geo.fat_type == FAT_TYPE_32)
+    return ((uint32_t *)fat_table)[cluster];
+  return ((uint16_t *)fat_table)[cluster];
+}
+
+// clusterのエントリを含むFATの範囲がまだRAMになければ読み込み、
+// 空きクラスタをビットマップに反映する
+static void fat_load(uint32_t cluster) {
+  uint32_t chunk = cluster / FAT_ENTRIES_PER_SECTOR / FAT_LOAD_SECTORS;
+  if (test_bit(fat_loaded, chunk))
+    return;
+
+  uint32_t first = chunk * FAT_LOAD_SECTORS;
+  uint32_t n = fat_sectors - first;
+  if (n > FAT_LOAD_SECTORS)
+    n = FAT_LOAD_SECTORS;
+  read_write_sectors((uint8_t *)fat_table + first * BPB_BytsPerSec,
+                     FAT1_START_SECTOR + first, n, 0);
+  set_bit(fat_loaded, chunk);
+
+  uint32_t c = first * FAT_ENTRIES_PER_SECTOR;
+  uint32_t end = (first + n) * FAT_ENTRIES_PER_SECTOR;
+  if (end > FAT_ENTRY_NUM)
+    end = FAT_ENTRY_NUM;
+  for (c = c < 2 ? 2 : c; c < end; c++) {
+    // FAT32の上位4ビットは予約
+    if ((fat_raw_entry(c) & 0x0FFFFFFF) == FAT_FREE)
+      set_bit(free_bitmap, c);
+  }
+}
+
+static inline bool cluster_is_free(uint32_t cluster) {
+  fat_load(cluster);
+  return test_bit(free_bitmap, cluster);
+}
+
+static void reset_fat_tables(void) {
+  uint32_t chunks = (fat_sectors + FAT_LOAD_SECTORS - 1) / FAT_LOAD_SECTORS;
+  memset(fat_loaded, 0, 4 * words_for(chunks));
+  memset(fat_dirty, 0, 4 * words_for(fat_sectors));
+  memset(fat_mirror_dirty, 0, 4 * words_for(fat_sectors));
+  memset(free_bitmap, 0, 4 * words_for(FAT_ENTRY_NUM));
+  fsinfo_dirty = false;
+  alloc_hint = 2;
+}
+
+// FAT全体を読み込んで空きクラスタを数える
+static void count_free_clusters(void) {
+  free_clusters = 0;
+  for (uint32_t c = 2; c < FAT_ENTRY_NUM; c++) {
+    if (cluster_is_free(c))
+      free_clusters++;
+  }
+}
+
 void read_fat_from_disk(void) {
-  for (int i = 0; i < BPB_FATSz16; i++) {
-    read_write_disk(&fat[i * (BPB_BytsPerSec / 2)], FAT1_START_SECTOR + i, 0);
+  reset_fat_tables();
+
+  if (fat16_geo.fat_type == FAT_TYPE_32) {
+    uint8_t buf[SECTOR_SIZE];
+    struct fsinfo *fsi = (struct fsinfo *)buf;
+    if (fat16_geo.fsinfo_sector != 0 &&
+        bcache_read(buf, fat16_geo.fsinfo_sector, 1) == 0 &&
+        fsi->LeadSig == FSI_LEAD_SIG && fsi->StrucSig == FSI_STRUC_SIG &&
+        fsi->TrailSig == FSI_TRAIL_SIG) {
+      if (fsi->Free_Count <= fat16_geo.cluster_count) {
+        free_clusters = fsi->Free_Count;
+        if (fat_cluster_valid(fsi->Nxt_Free))
+          alloc_hint = fsi->Nxt_Free;
+        return;
+      }
+      // 空き数が壊れていればFATを走査して数え直し、同期のときに書き直す
+      fsinfo_dirty = true;
+    } else {
+      // 署名が合わないセクタはFSInfoではないので、空き数はメモリ上だけで持つ
+      fat16_geo.fsinfo_sector = 0;
+    }
   }
+  count_free_clusters();
 }
 
-void write_fat_to_disk(void) {
-  // FAT1 書き戻し
-  for (int i = 0; i < BPB_FATSz16; i++) {
-    read_write_disk(&fat[i * (BPB_BytsPerSec / 2)], FAT1_START_SECTOR + i, 1);
+// フォーマット直後の、すべてのクラスタが空いているFATを作る
+static void init_empty_fat(void) {
+  reset_fat_tables();
+  memset(fat_table, 0, fat_sectors * BPB_BytsPerSec);
+  uint32_t chunks = (fat_sectors + FAT_LOAD_SECTORS - 1) / FAT_LOAD_SECTORS;
+  for (uint32_t i = 0; i < chunks; i++)
+    set_bit(fat_loaded, i);
+  for (uint32_t c = 2; c < FAT_ENTRY_NUM; c++)
+    set_bit(free_bitmap, c);
+  free_clusters = fat16_geo.cluster_count;
+  fsinfo_dirty = true;
+}
+
+uint32_t get_fat_entry(uint32_t cluster) {
+  fat_load(cluster);
+  uint32_t value = fat_raw_entry(cluster);
+  if (fat16_geo.fat_type == FAT_TYPE_32)
+    return value & 0x0FFFFFFF;
+  // FAT16の予約値 (0xFFF7以上) はFAT32の値にそろえる
+  return value >= 0xFFF7 ? value | 0x0FFF0000 : value;
+}
+
+void set_fat_entry(uint32_t cluster, uint32_t value) {
+  uint32_t old = get_fat_entry(cluster);
+  if (cluster >= 2) {
+    if (old == FAT_FREE && value != FAT_FREE) {
+      clear_bit(free_bitmap, cluster);
+      // FSInfoの空き数は目安なので、実際より少なければここで数え直す
+      if (free_clusters > 0)
+        free_clusters--;
+      else
+        count_free_clusters();
+      fsinfo_dirty = true;
+    } else if (old != FAT_FREE && value == FAT_FREE) {
+      set_bit(free_bitmap, cluster);
+      free_clusters++;
+      fsinfo_dirty = true;
+    }
   }
 
-  // FAT2 書き戻し（ミラー）
-  for (int i = 0; i < BPB_FATSz16; i++) {
-    read_write_disk(&fat[i * (BPB_BytsPerSec / 2)], FAT2_START_SECTOR + i, 1);
+  if (fat16_geo.fat_type == FAT_TYPE_32) {
+    uint32_t *e = &((uint32_t *)fat_table)[cluster];
+    *e = (*e & 0xF0000000) | (value & 0x0FFFFFFF);
+  } else {
+    ((uint16_t *)fat_table)[cluster] = value;
   }
+  unsigned sec = cluster / FAT_ENTRIES_PER_SECTOR;
+  set_bit(fat_dirty, sec);
+  set_bit(fat_mirror_dirty, sec);
 }
 
-int create_file(const char *name, const uint8_t *data, uint32_t size) {
-  // FAT / root_dir 読み込み
-  read_fat_from_disk();
-  read_root_dir_from_disk();
+// alloc_hintから1周して、n個の空きクラスタが連続する範囲を探す。
+// 見つからなければ最も長い範囲を返す。*lenにその長さを入れる
+static uint32_t find_free_run(unsigned n, unsigned *len) {
+  uint32_t best = 0;
+  unsigned best_len = 0;
+  uint32_t c = alloc_hint;
+  for (uint32_t scanned = 0; scanned < FAT_ENTRY_NUM - 2;) {
+    if (c >= FAT_ENTRY_NUM)
+      c = 2;
+    // 32クラスタ単位で空きのない部分を読み飛ばす
+    if (c % 32 == 0) {
+      fat_load(c);
+      if (free_bitmap[c / 32] == 0) {
+        scanned += 32;
+        c += 32;
+        continue;
+      }
+    }
+    if (!cluster_is_free(c)) {
+      scanned++;
+      c++;
+      continue;
+    }
 
-  // root_dir 空きエントリ探索
-  int entry_index = -1;
-  for (int i = 0; i < BPB_RootEntCnt; i++) {
-    if (root_dir[i].name[0] == 0x00 || root_dir[i].name[0] == 0xE5) {
-      entry_index = i;
-      break;
+    unsigned run = 0;
+    while (c + run < FAT_ENTRY_NUM && run < n && cluster_is_free(c + run))
+      run++;
+    if (run > best_len) {
+      best = c;
+      best_len = run;
+      if (run == n)
+        break;
+    }
+    scanned += run;
+    c += run;
+  }
+  *len = best_len;
+  return best;
+}
+
+static void free_cluster_chain(uint32_t cluster);
+
+uint32_t alloc_cluster_chain(uint32_t prev, unsigned n) {
+  // free_clustersはFSInfoから得た目安のことがあるので、それでは断らずに
+  // ビットマップを探し、見つからなかったときだけ失敗する
+  if (n == 0)
+    return 0;
+
+  uint32_t first = 0;
+  uint32_t tail = prev;
+  while (n > 0) {
+    // 直前のクラスタのすぐ後ろが空いていれば、そこから伸ばす
+    uint32_t start;
+    unsigned len;
+    if (tail >= 2 && tail + 1 < FAT_ENTRY_NUM && cluster_is_free(tail + 1)) {
+      start = tail + 1;
+      len = 1;
+      while (len < n && start + len < FAT_ENTRY_NUM &&
+             cluster_is_free(start + len))
+        len++;
+    } else {
+      start = find_free_run(n, &len);
+    }
+
+    if (len == 0) {
+      // 空きが足りない。確保した分を戻して失敗する。FSInfoの空き数が
+      // 実際と食い違っていたかもしれないので、ここで数え直しておく
+      if (first != 0)
+        free_cluster_chain(first);
+      if (prev >= 2)
+        set_fat_entry(prev, FAT_EOC);
+      count_free_clusters();
+      fsinfo_dirty = true;
+      return 0;
+    }
+
+    for (unsigned i = 0; i < len; i++) {
+      uint32_t c = start + i;
+      set_fat_entry(c, FAT_EOC);
+      if (tail >= 2)
+        set_fat_entry(tail, c);
+      if (first == 0)
+        first = c;
+      tail = c;
     }
+    n -= len;
+  }
+
+  alloc_hint = tail + 1 < FAT_ENTRY_NUM ? tail + 1 : 2;
+  return first;
+}
+
+void write_fat_to_disk(void) {
+  // FAT2以降 (ミラー) とFSInfoは同期のときにまとめて更新する
+  blk_plug();
+  write_dirty_sectors(fat_table, fat_dirty, fat_sectors, FAT1_START_SECTOR);
+  memset(fat_dirty, 0, 4 * words_for(fat_sectors));
+  blk_unplug();
+}
+
+static void write_fsinfo_to_disk(void) {
+  uint8_t buf[SECTOR_SIZE];
+  memset(buf, 0, sizeof(buf));
+  struct fsinfo *fsi = (struct fsinfo *)buf;
+  fsi->LeadSig = FSI_LEAD_SIG;
+  fsi->StrucSig = FSI_STRUC_SIG;
+  fsi->Free_Count = free_clusters;
+  fsi->Nxt_Free = alloc_hint;
+  fsi->TrailSig = FSI_TRAIL_SIG;
+  bcache_write(buf, fat16_geo.fsinfo_sector, 1);
+  fsinfo_dirty = false;
+}
+
+static int do_create_file(const char *name, const uint8_t *data,
+                          uint32_t size);
+
+// データ、FAT、ルートディレクトリの書き込みはキューでまとめて発行する
+// これまでの書き込みをディスクに永続化する
+int fat16_sync(void) {
+  // ボリュームをまだ用意していなければ (BLK_BENCHなど)、FATは書かずに
+  // デバイスの書き込みキャッシュだけを書き出す
+  if (!fat_table)
+    return blk_sync();
+  blk_plug();
+  write_dirty_sectors(fat_table, fat_dirty, fat_sectors, FAT1_START_SECTOR);
+  memset(fat_dirty, 0, 4 * words_for(fat_sectors));
+  // 2つ目以降のFATには同じセクタをそれぞれ書き込む
+  for (uint32_t i = 1; i < fat16_geo.num_fats; i++)
+    write_dirty_sectors(fat_table, fat_mirror_dirty, fat_sectors,
+                        FAT1_START_SECTOR + i * fat16_geo.fat_size);
+  memset(fat_mirror_dirty, 0, 4 * words_for(fat_sectors));
+  if (fat16_geo.fsinfo_sector != 0 && fsinfo_dirty)
+    write_fsinfo_to_disk();
+  if (blk_unplug() < 0)
+    return -1;
+  return blk_sync();
+}
+
+int create_file(const char *name, const uint8_t *data, uint32_t size) {
+  blk_plug();
+  int ret = do_create_file(name, data, size);
+  if (blk_unplug() < 0)
+    return -1;
+  return ret;
+}
+
+static int do_create_file(const char *name, const uint8_t *data,
+                          uint32_t size) {
+  char packed[11];
+  if (pack_83_name(name, packed) < 0) {
+    printf("[FAT16] ERROR: invalid 8.3 file name: %s\n", name);
+    return -1;
   }
+
+  // root_dir 空きエントリ (番号の最も小さいもの)
+  // FAT32ではルートディレクトリにクラスタを足して空きを作る
+  if (dir_free_head < 0)
+    grow_root_dir();
+  int entry_index = dir_free_head;
   if (entry_index < 0) {
     printf("[FAT16] ERROR: Root directory is full. Cannot create new file.\n");
     return -1;
   }
 
-  // 最初のクラスタ確保
-  int free_cluster = -1;
-  for (int i = 2; i < FAT_ENTRY_NUM; i++) {
-    if (fat[i] == 0x0000) {
-      free_cluster = i;
-      break;
-    }
-  }
-  if (free_cluster < 0) {
+  // ファイル全体のクラスタを (できるだけ連続して) まとめて確保
+  unsigned clusters = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (clusters == 0)
+    clusters = 1;
+  uint32_t free_cluster = alloc_cluster_chain(0, clusters);
+  if (free_cluster == 0) {
     printf("[FAT16] ERROR: no free FAT cluster.\n");
     return -1;
   }
 
   struct dir_entry *de = &root_dir[entry_index];
-  memset(de->name, ' ', 8);
-  memset(de->ext, ' ', 3);
-
-  int n = 0;
-  while (n < 8 && name[n] && name[n] != '.') {
-    de->name[n] = name[n];
-    n++;
-  }
-  if (name[n] == '.') {
-    n++;
-    for (int e = 0; e < 3 && name[n + e]; e++) {
-      de->ext[e] = name[n + e];
-    }
-  }
+  memcpy(de->name, packed, 8);
+  memcpy(de->ext, packed + 8, 3);
+  dir_free_head = dir_next[entry_index];
+  dir_index_insert(entry_index);
 
-  de->start_cluster = free_cluster;
+  dir_entry_set_cluster(de, free_cluster);
   de->size = size;
+  mark_dir_entry_dirty(de);
 
   // データ書き込み
   uint32_t remaining = size;
-  uint16_t cluster = free_cluster;
-  uint8_t cluster_buf[BPB_BytsPerSec * BPB_SecPerClus];
+  uint32_t cluster = free_cluster;
 
   while (remaining > 0) {
-    uint32_t to_write = remaining;
-    if (to_write > BPB_BytsPerSec * BPB_SecPerClus)
-      to_write = BPB_BytsPerSec * BPB_SecPerClus;
-
-    if (data) {
-      memcpy(cluster_buf, data, to_write);
+    uint32_t to_write = remaining > CLUSTER_SIZE ? CLUSTER_SIZE : remaining;
+    put_cluster(cluster, data, to_write);
+    if (data)
       data += to_write;
-    } else {
-      memset(cluster_buf, 0, to_write);
-    }
-    if (to_write < BPB_BytsPerSec * BPB_SecPerClus)
-      memset(cluster_buf + to_write, 0,
-             BPB_BytsPerSec * BPB_SecPerClus - to_write);
-
-    write_cluster(cluster, cluster_buf);
     remaining -= to_write;
-
-    if (remaining > 0) {
-      // 次クラスタを確保
-      uint16_t next_cluster = 0;
-      for (uint16_t i = 2; i < FAT_ENTRY_NUM; i++) {
-        if (fat[i] == 0x0000) {
-          next_cluster = i;
-          break;
-        }
-      }
-      if (next_cluster == 0) {
-        printf("[FAT16] ERROR: not enough clusters.\n");
-        return -1;
-      }
-      fat[cluster] = next_cluster;
-      fat[next_cluster] = 0xFFFF;
-      cluster = next_cluster;
-    } else {
-      fat[cluster] = 0xFFFF; // 最後のクラスタ
-    }
+    cluster = get_fat_entry(cluster);
   }
 
   // FAT書き戻し
@@ -232,12 +974,9 @@ int create_file(const char *name, const uint8_t *data, uint32_t size) {
 }
 
 void fat16_list_root_dir(void) {
-  // 1. ディスクから最新の root_dir を読み込む
-  read_root_dir_from_disk();
-
   printf("=== Root Directory ===\n");
 
-  for (int i = 0; i < BPB_RootEntCnt; i++) {
+  for (int i = 0; i < (int)fat16_geo.root_ent_cnt; i++) {
     // 未使用エントリ → ここから先は全部空
     if (root_dir[i].name[0] == 0x00) {
       break;
@@ -247,7 +986,7 @@ void fat16_list_root_dir(void) {
       continue;
     }
 
-    // 2. ファイル名（8 + 3）を組み立て
+    // 1. ファイル名（8 + 3）を組み立て
     char name[13];
     int p = 0;
 
@@ -268,83 +1007,144 @@ void fat16_list_root_dir(void) {
 
     name[p] = '\0';
 
-    // 3. 表示
+    // 2. 表示
     printf("%s  size=", name);
     printf("%d", (int)root_dir[i].size);
     printf("  cluster=");
-    printf("%d\n", (int)root_dir[i].start_cluster);
+    printf("%d\n", (int)dir_entry_cluster(&root_dir[i]));
   }
 }
 
-// ファイル読み込み
-static uint16_t alloc_free_cluster(void) {
-  for (uint16_t i = 2; i < FAT_ENTRY_NUM; i++) {
-    if (fat[i] == 0x0000)
-      return i;
+// clusterから始まるチェーンを解放し、解放したクラスタの範囲をデバイスに伝える
+static void free_cluster_chain(uint32_t cluster) {
+  uint32_t run_start = 0;
+  unsigned run_len = 0;
+  while (fat_cluster_valid(cluster)) {
+    uint32_t next = get_fat_entry(cluster);
+    set_fat_entry(cluster, FAT_FREE);
+    // ディスク上で連続しているクラスタはまとめてDISCARDする
+    if (run_len > 0 && cluster == run_start + run_len) {
+      run_len++;
+    } else {
+      if (run_len > 0)
+        bcache_discard(cluster_to_sector(run_start),
+                       run_len * fat16_geo.sec_per_clus);
+      run_start = cluster;
+      run_len = 1;
+    }
+    cluster = next;
   }
-  return 0;
+  if (run_len > 0)
+    bcache_discard(cluster_to_sector(run_start),
+                   run_len * fat16_geo.sec_per_clus);
 }
 
-int read_file(uint16_t start_cluster, uint8_t *buf, uint32_t size) {
+// clusterから始まるチェーンのcount個のクラスタを先読みする。
+// ディスク上で連続している部分ごとにまとめて発行する
+void fat16_readahead(uint32_t cluster, unsigned count) {
+  while (count > 0 && fat_cluster_valid(cluster)) {
+    uint32_t first = cluster;
+    unsigned n = 1;
+    count--;
+    cluster = get_fat_entry(cluster);
+    while (count > 0 && cluster == first + n) {
+      n++;
+      count--;
+      cluster = get_fat_entry(cluster);
+    }
+    bcache_readahead(cluster_to_sector(first), n * fat16_geo.sec_per_clus);
+  }
+}
+
+// ファイル読み込み
+int read_file(uint32_t start_cluster, uint8_t *buf, uint32_t size) {
   if (size == 0)
     return 0;
 
-  if (!buf || start_cluster < 2 || start_cluster >= FAT_ENTRY_NUM)
+  if (!buf || !fat_cluster_valid(start_cluster))
     return -1;
 
-  read_fat_from_disk();
-
   uint32_t remaining = size;
-  uint16_t cluster = start_cluster;
-  uint8_t cluster_buf[CLUSTER_SIZE];
+  uint32_t cluster = start_cluster;
 
   while (remaining > 0) {
-    if (cluster == 0x0000 || cluster == 0xFFFF || cluster >= FAT_ENTRY_NUM)
+    if (!fat_cluster_valid(cluster))
       return -1;
 
-    read_cluster(cluster, cluster_buf);
+    if (remaining < CLUSTER_SIZE) {
+      // 末尾の端数クラスタだけは一時バッファ経由で読む
+      read_cluster(cluster, cluster_buf);
+      memcpy(buf, cluster_buf, remaining);
+      break;
+    }
+
+    // ディスク上で連続しているクラスタはまとめて読む。
+    // キャッシュにない部分だけがデバイスへのリクエストになる
+    uint32_t first = cluster;
+    unsigned clusters = 1;
+    remaining -= CLUSTER_SIZE;
+    cluster = get_fat_entry(cluster);
+    while (remaining >= CLUSTER_SIZE && cluster == first + clusters &&
+           (clusters + 1) * fat16_geo.sec_per_clus <= VIRTIO_BLK_MAX_SECTORS) {
+      clusters++;
+      remaining -= CLUSTER_SIZE;
+      cluster = get_fat_entry(cluster);
+    }
 
-    uint32_t to_copy = remaining > CLUSTER_SIZE ? CLUSTER_SIZE : remaining;
-    memcpy(buf, cluster_buf, to_copy);
-    buf += to_copy;
-    remaining -= to_copy;
+    // 次の部分の読み込みを先に発行しておき、この部分の読み込みと重ねる
+    if (remaining > 0) {
+      unsigned ahead = (remaining + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+      unsigned max_ahead = BCACHE_RA_SECTORS / fat16_geo.sec_per_clus;
+      if (max_ahead == 0)
+        max_ahead = 1;
+      if (ahead > max_ahead)
+        ahead = max_ahead;
+      fat16_readahead(cluster, ahead);
+    }
 
-    cluster = fat[cluster];
+    if (bcache_read(buf, cluster_to_sector(first),
+                    clusters * fat16_geo.sec_per_clus) < 0)
+      return -1;
+    buf += clusters * CLUSTER_SIZE;
   }
 
   return 0;
 }
 
 // ファイル書き込み
-int write_file(uint16_t start_cluster, const uint8_t *buf, uint32_t size) {
-  if (start_cluster < 2 || start_cluster >= FAT_ENTRY_NUM)
-    return -1;
+static int do_write_file(uint32_t start_cluster, const uint8_t *buf,
+                         uint32_t size);
 
-  read_fat_from_disk();
-  read_root_dir_from_disk();
+int write_file(uint32_t start_cluster, const uint8_t *buf, uint32_t size) {
+  blk_plug();
+  int ret = do_write_file(start_cluster, buf, size);
+  if (blk_unplug() < 0)
+    return -1;
+  return ret;
+}
 
-  uint8_t cluster_buf[CLUSTER_SIZE];
+static int do_write_file(uint32_t start_cluster, const uint8_t *buf,
+                         uint32_t size) {
+  if (!fat_cluster_valid(start_cluster))
+    return -1;
 
   // サイズ0への書き込みはファイル長だけを更新し、余剰クラスタを解放する
   if (size == 0) {
-    uint16_t next = fat[start_cluster];
-    fat[start_cluster] = 0xFFFF;
-    while (next != 0xFFFF && next != 0x0000) {
-      uint16_t tmp = fat[next];
-      fat[next] = 0x0000;
-      next = tmp;
-    }
+    uint32_t next = get_fat_entry(start_cluster);
+    set_fat_entry(start_cluster, FAT_EOC);
+    free_cluster_chain(next);
 
-    memset(cluster_buf, 0, sizeof(cluster_buf));
-    write_cluster(start_cluster, cluster_buf);
+    bcache_write_zeroes(cluster_to_sector(start_cluster),
+                        fat16_geo.sec_per_clus);
 
-    for (int i = 0; i < BPB_RootEntCnt; i++) {
+    for (int i = 0; i < (int)fat16_geo.root_ent_cnt; i++) {
       if (root_dir[i].name[0] == 0x00)
         break;
       if (root_dir[i].name[0] == 0xE5)
         continue;
-      if (root_dir[i].start_cluster == start_cluster) {
+      if (dir_entry_cluster(&root_dir[i]) == start_cluster) {
         root_dir[i].size = 0;
+        mark_dir_entry_dirty(&root_dir[i]);
         break;
       }
     }
@@ -355,54 +1155,44 @@ int write_file(uint16_t start_cluster, const uint8_t *buf, uint32_t size) {
   }
 
   uint32_t remaining = size;
-  uint16_t cur = start_cluster;
+  uint32_t cur = start_cluster;
 
   while (remaining > 0) {
-    if (cur == 0x0000 || cur >= FAT_ENTRY_NUM)
+    if (!fat_cluster_valid(cur))
       return -1;
 
     uint32_t to_write = remaining > CLUSTER_SIZE ? CLUSTER_SIZE : remaining;
-    if (buf) {
-      memcpy(cluster_buf, buf, to_write);
+    put_cluster(cur, buf, to_write);
+    if (buf)
       buf += to_write;
-    } else {
-      memset(cluster_buf, 0, to_write);
-    }
-    if (to_write < CLUSTER_SIZE)
-      memset(cluster_buf + to_write, 0, CLUSTER_SIZE - to_write);
-
-    write_cluster(cur, cluster_buf);
     remaining -= to_write;
 
     if (remaining == 0)
       break;
 
-    uint16_t next = fat[cur];
-    if (next == 0x0000 || next == 0xFFFF) {
-      next = alloc_free_cluster();
+    uint32_t next = get_fat_entry(cur);
+    if (!fat_cluster_valid(next)) {
+      // 残りの分をまとめて (できるだけ連続して) 確保する
+      next = alloc_cluster_chain(cur, (remaining + CLUSTER_SIZE - 1) /
+                                          CLUSTER_SIZE);
       if (next == 0)
         return -1;
-      fat[cur] = next;
-      fat[next] = 0xFFFF;
     }
     cur = next;
   }
 
-  uint16_t next = fat[cur];
-  fat[cur] = 0xFFFF;
-  while (next != 0xFFFF && next != 0x0000) {
-    uint16_t tmp = fat[next];
-    fat[next] = 0x0000;
-    next = tmp;
-  }
+  uint32_t next = get_fat_entry(cur);
+  set_fat_entry(cur, FAT_EOC);
+  free_cluster_chain(next);
 
-  for (int i = 0; i < BPB_RootEntCnt; i++) {
+  for (int i = 0; i < (int)fat16_geo.root_ent_cnt; i++) {
     if (root_dir[i].name[0] == 0x00)
       break;
     if (root_dir[i].name[0] == 0xE5)
       continue;
-    if (root_dir[i].start_cluster == start_cluster) {
+    if (dir_entry_cluster(&root_dir[i]) == start_cluster) {
       root_dir[i].size = size;
+      mark_dir_entry_dirty(&root_dir[i]);
       break;
     }
   }
@@ -413,11 +1203,7 @@ int write_file(uint16_t start_cluster, const uint8_t *buf, uint32_t size) {
 }
 
 void fat16_concatenate_first_file(void) {
-  // 1. 最新の FAT と root_dir を読み込む（FAT を必ず先に）
-  read_fat_from_disk();
-  read_root_dir_from_disk();
-
-  // 2. 最初の有効エントリを探す
+  // 1. 最初の有効エントリを探す
   struct dir_entry *target = NULL;
   for (int i = 0; i < 16; i++) {
     if (root_dir[i].name[0] == 0x00)
@@ -439,17 +1225,17 @@ void fat16_concatenate_first_file(void) {
     return;
   }
 
-  // 3. ファイルサイズぶんのバッファを確保
+  // 2. ファイルサイズぶんのバッファを確保
   uint32_t size = target->size;
   uint8_t buf[size]; // ※簡易実装としてスタック確保
 
-  // 4. read_file() でデータ領域を読む
-  if (read_file(target->start_cluster, buf, size) < 0) {
+  // 3. read_file() でデータ領域を読む
+  if (read_file(dir_entry_cluster(target), buf, size) < 0) {
     printf("[cat] read error.\n");
     return;
   }
 
-  // 5. ファイル内容をそのまま表示
+  // 4. ファイル内容をそのまま表示
   printf("===== cat: file content =====\n");
   for (uint32_t i = 0; i < size; i++) {
     kputchar(buf[i]);
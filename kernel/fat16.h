@@ -4,37 +4,81 @@
 #include "kernel_defs.h"
 
 // ブートセクタ
+// 扱うセクタサイズと、フォーマットするときの既定値
 #define BPB_BytsPerSec 512
-#define BPB_SecPerClus 1
 #define BPB_RsvdSecCnt 1
 #define BPB_NumFATs 2
 #define BPB_RootEntCnt 512
-#define BPB_FATSz16 32
+
+// 1にすると、ディスクに有効なボリュームがあっても起動時にフォーマットする
+#ifndef FAT16_FORMAT
+#define FAT16_FORMAT 0
+#endif
+
+// FATの種類。クラスタ数で決まる
+#define FAT_TYPE_16 16
+#define FAT_TYPE_32 32
+
+// FAT16の上限。FATは最大256セクタ、クラスタは最大64セクタ (32KiB)
+#define FAT16_FAT_SECTORS_MAX 256
+#define FAT16_CLUSTERS_MAX 65524
+#define FAT16_SEC_PER_CLUS_MAX 64
+// これより大きいディスクはFAT32でフォーマットする (2GiB)
+#define FAT16_FORMAT_SECTORS_MAX 4194304
+
+// FAT32。FATはRAM上に置くので、使うクラスタ数に上限を設ける (FATは8MiB)
+#define FAT32_RSVD_SEC_CNT 32
+#define FAT32_CLUSTERS_MAX (1u << 21)
+#define FAT32_FSINFO_SECTOR 1
+#define FAT32_BACKUP_BOOT_SECTOR 6
+
+// RAM上に持つルートディレクトリのエントリ数の上限
+#define ROOT_ENT_MAX 2048
+
+// FATエントリの値。FAT16の値もFAT32と同じ28ビットの範囲に広げて扱う
+#define FAT_FREE 0x00000000
+#define FAT_EOC 0x0FFFFFFF
+
+// ボリュームの配置。マウント時はBPBから、フォーマット時はディスクの容量から
+// 決める
+struct fat16_geometry {
+  uint32_t fat_type; // FAT_TYPE_16 か FAT_TYPE_32
+  uint32_t sec_per_clus;
+  uint32_t rsvd_sec_cnt;
+  uint32_t num_fats;
+  uint32_t fat_size;     // FAT1つあたりのセクタ数
+  uint32_t root_ent_cnt; // FAT32では今のルートディレクトリに入るエントリ数
+  uint32_t total_sectors;
+  uint32_t fat_start;        // FAT1の先頭セクタ
+  uint32_t root_dir_start;   // FAT16のみ
+  uint32_t root_dir_sectors; // FAT16のみ
+  uint32_t root_cluster;     // FAT32のみ
+  uint32_t fsinfo_sector;    // FAT32のみ
+  uint32_t data_start;
+  uint32_t cluster_count; // データ領域のクラスタ数
+};
+
+extern struct fat16_geometry fat16_geo;
 
 // クラスタサイズ（バイト）
-#define CLUSTER_SIZE (BPB_SecPerClus * BPB_BytsPerSec)
+#define CLUSTER_SIZE (fat16_geo.sec_per_clus * BPB_BytsPerSec)
 
 // FAT領域
-#define FAT1_START_SECTOR BPB_RsvdSecCnt
-#define FAT2_START_SECTOR (FAT1_START_SECTOR + BPB_FATSz16)
-#define FAT_ENTRY_NUM ((BPB_FATSz16 * BPB_BytsPerSec) / 2)
+#define FAT1_START_SECTOR (fat16_geo.fat_start)
+// 有効なクラスタ番号は2からFAT_ENTRY_NUM - 1まで
+#define FAT_ENTRY_NUM (fat16_geo.cluster_count + 2)
 
-// ルートディレクトリ
-#define ROOT_DIR_START_SECTOR (BPB_RsvdSecCnt + BPB_NumFATs * BPB_FATSz16)
-#define ROOT_DIR_SECTORS                                                       \
-  ((BPB_RootEntCnt * 32 + BPB_BytsPerSec - 1) / BPB_BytsPerSec)
+// ルートディレクトリ (FAT16)
+#define ROOT_DIR_START_SECTOR (fat16_geo.root_dir_start)
+#define ROOT_DIR_SECTORS (fat16_geo.root_dir_sectors)
 
 // データ領域
-#define DATA_START_SECTOR (ROOT_DIR_START_SECTOR + ROOT_DIR_SECTORS)
-
-// データ領域のセクタ数
-#define DATA_SEC (FAT_ENTRY_NUM * BPB_SecPerClus)
+#define DATA_START_SECTOR (fat16_geo.data_start)
 
-// ボリューム全体のセクタ数 TotSec16
-#define BPB_TotSec16                                                           \
-  (BPB_RsvdSecCnt + BPB_NumFATs * BPB_FATSz16 + ROOT_DIR_SECTORS + DATA_SEC)
+static inline bool fat_cluster_valid(uint32_t cluster) {
+  return cluster >= 2 && cluster < FAT_ENTRY_NUM;
+}
 
-extern uint16_t fat[FAT_ENTRY_NUM];
 #pragma pack(push, 1)
 struct dir_entry {
   char name[8];
@@ -82,20 +126,106 @@ struct bpb_fat16 {
 };
 #pragma pack(pop)
 
-extern struct dir_entry root_dir[BPB_RootEntCnt];
+#pragma pack(push, 1)
+struct bpb_fat32 {
+  uint8_t jmpBoot[3];  // 0x00
+  uint8_t OEMName[8];  // 0x03
+  uint16_t BytsPerSec; // 0x0B
+  uint8_t SecPerClus;  // 0x0D
+  uint16_t RsvdSecCnt; // 0x0E
+  uint8_t NumFATs;     // 0x10
+  uint16_t RootEntCnt; // 0x11 (0)
+  uint16_t TotSec16;   // 0x13 (0)
+  uint8_t Media;       // 0x15
+  uint16_t FATSz16;    // 0x16 (0)
+  uint16_t SecPerTrk;  // 0x18
+  uint16_t NumHeads;   // 0x1A
+  uint32_t HiddSec;    // 0x1C
+  uint32_t TotSec32;   // 0x20
+
+  // FAT32 拡張BPB
+  uint32_t FATSz32;      // 0x24
+  uint16_t ExtFlags;     // 0x28
+  uint16_t FSVer;        // 0x2A
+  uint32_t RootClus;     // 0x2C
+  uint16_t FSInfo;       // 0x30
+  uint16_t BkBootSec;    // 0x32
+  uint8_t Reserved[12];  // 0x34
+  uint8_t DrvNum;        // 0x40
+  uint8_t Reserved1;     // 0x41
+  uint8_t BootSig;       // 0x42
+  uint32_t VolID;        // 0x43
+  uint8_t VolLab[11];    // 0x47
+  uint8_t FilSysType[8]; // 0x52
+
+  // 0x5A〜0x1FD はブートコード領域
+};
+#pragma pack(pop)
+
+// FAT32のFSInfoセクタ。空きクラスタ数と次に探し始める位置のヒント
+#define FSI_LEAD_SIG 0x41615252
+#define FSI_STRUC_SIG 0x61417272
+#define FSI_TRAIL_SIG 0xAA550000
+#define FSI_UNKNOWN 0xFFFFFFFF
+
+#pragma pack(push, 1)
+struct fsinfo {
+  uint32_t LeadSig;       // 0x000
+  uint8_t Reserved1[480]; // 0x004
+  uint32_t StrucSig;      // 0x1E4
+  uint32_t Free_Count;    // 0x1E8
+  uint32_t Nxt_Free;      // 0x1EC
+  uint8_t Reserved2[12];  // 0x1F0
+  uint32_t TrailSig;      // 0x1FC
+};
+#pragma pack(pop)
+
+// ディレクトリエントリの先頭クラスタ。FAT32では上位16ビットがhigh_clusterに入る
+static inline uint32_t dir_entry_cluster(const struct dir_entry *de) {
+  if (fat16_geo.fat_type == FAT_TYPE_32)
+    return ((uint32_t)de->high_cluster << 16) | de->start_cluster;
+  return de->start_cluster;
+}
+
+static inline void dir_entry_set_cluster(struct dir_entry *de,
+                                         uint32_t cluster) {
+  de->start_cluster = cluster & 0xFFFF;
+  de->high_cluster =
+      fat16_geo.fat_type == FAT_TYPE_32 ? (cluster >> 16) & 0x0FFF : 0;
+}
+
+extern struct dir_entry root_dir[ROOT_ENT_MAX];
+
+// fat16_mountの失敗の種類
+#define FAT_MOUNT_NONE -1        // FATボリュームがない (フォーマットしてよい)
+#define FAT_MOUNT_UNSUPPORTED -2 // 扱えないFATボリュームがある
 
 void init_fat16_disk(void);
-void read_cluster(uint16_t cluster, void *buf);
-void write_cluster(uint16_t cluster, void *buf);
+int fat16_mount(void);
+void read_cluster(uint32_t cluster, void *buf);
+void write_cluster(uint32_t cluster, const void *buf);
+int read_clusters(uint32_t cluster, unsigned count, void *buf);
+void zero_clusters(uint32_t cluster, unsigned count);
 void copy_name_dynamic(char **name_field, const char *src);
 int create_file(const char *name, const uint8_t *data, uint32_t size);
-int read_file(uint16_t start_cluster, uint8_t *buf, uint32_t size);
-int write_file(uint16_t start_cluster, const uint8_t *buf, uint32_t size);
+int read_file(uint32_t start_cluster, uint8_t *buf, uint32_t size);
+void fat16_readahead(uint32_t cluster, unsigned count);
+int write_file(uint32_t start_cluster, const uint8_t *buf, uint32_t size);
 void fat16_list_root_dir(void);
 void fat16_concatenate_first_file(void);
 void read_fat_from_disk(void);
 void write_fat_to_disk(void);
+// FATエントリを読み書きする。値はFAT_FREE, FAT_EOC, 次のクラスタ番号など
+uint32_t get_fat_entry(uint32_t cluster);
+void set_fat_entry(uint32_t cluster, uint32_t value);
+// prevの後ろにn個のクラスタをつないで確保し、最初のクラスタを返す。
+// prevが0なら新しいチェーンを作る。できるだけ連続した範囲から取り、
+// 空きが足りなければ何もせずに0を返す
+uint32_t alloc_cluster_chain(uint32_t prev, unsigned n);
 void read_root_dir_from_disk(void);
 void write_root_dir_to_disk(void);
+void mark_dir_entry_dirty(const struct dir_entry *de);
+struct dir_entry *find_dir_entry_by_path(const char *path);
+int fat16_sync(void);
 
 #endif
@@ -1,5 +1,8 @@
 #include "kernel.h"
+#include "bcache.h"
+#include "blk.h"
 #include "fat16.h"
+#include "plic.h"
 #include "virtio.h"
 
 typedef unsigned char uint8_t;
@@ -15,6 +18,12 @@ static int kfopen(const char *path, const char *mode);
 static int kfclose(int fd);
 static int kfgetc(int fd);
 static int kfputc(int fd, int ch);
+static int kfread(int fd, uint8_t *buf, uint32_t n);
+static int kfwrite(int fd, const uint8_t *buf, uint32_t n);
+static int kflseek(int fd, int offset, int whence);
+static int kfpread(int fd, uint8_t *buf, uint32_t n, uint32_t offset);
+static int kfpwrite(int fd, const uint8_t *buf, uint32_t n, uint32_t offset);
+static int kfsync(void);
 
 struct process procs[PROCS_MAX];
 struct process *current_proc;
@@ -101,6 +110,10 @@ struct process *create_process(const void *image, size_t image_size) {
 
   // MMIO領域をマッピングする
   map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
+  map_page(page_table, PLIC_PADDR, PLIC_PADDR, PAGE_R | PAGE_W);
+  map_page(page_table, PLIC_SENABLE & ~(PAGE_SIZE - 1),
+           PLIC_SENABLE & ~(PAGE_SIZE - 1), PAGE_R | PAGE_W);
+  map_page(page_table, PLIC_STHRESHOLD, PLIC_STHRESHOLD, PAGE_R | PAGE_W);
 
   // ユーザーのページをマッピングする
   for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
@@ -123,6 +136,7 @@ struct process *create_process(const void *image, size_t image_size) {
   proc->state = PROC_RUNNABLE;
   proc->sp = (uint32_t)sp;
   proc->page_table = page_table;
+  proc->user_size = align_up(image_size, PAGE_SIZE);
   return proc;
 }
 
@@ -198,6 +212,62 @@ void yield(void) {
   switch_context(&prev->sp, &next->sp);
 }
 
+// 外部割り込みを1つ処理する
+static void handle_external_interrupt(void) {
+  unsigned irq = plic_claim();
+  if (irq == 0)
+    return;
+
+  if (irq == VIRTIO_BLK_IRQ)
+    virtio_blk_handle_irq();
+  else
+    printf("unexpected irq %d\n", irq);
+
+  plic_complete(irq);
+}
+
+// 割り込みが来るまでCPUを止めて待ち、届いた割り込みを処理する。
+// sstatus.SIEは立てないので、トラップにはならずwfiから戻るだけ
+static void wait_for_interrupt(void) {
+  __asm__ __volatile__("wfi");
+  handle_external_interrupt();
+}
+
+static bool has_blocked_process(void) {
+  for (int i = 0; i < PROCS_MAX; i++) {
+    if (procs[i].state == PROC_BLOCKED)
+      return true;
+  }
+  return false;
+}
+
+// wqで待つ。戻ってきたら、呼び出し側で待っていた条件を確認し直すこと。
+// プロセスの文脈であれば眠って他のプロセスにCPUを譲る。起動処理中やアイドル中は
+// 譲る相手がいないので、割り込みが来るまでCPUを止めて待つ
+void sleep_on(struct wait_queue *wq) {
+  if (!current_proc || current_proc == idle_proc) {
+    wait_for_interrupt();
+    return;
+  }
+
+  current_proc->state = PROC_BLOCKED;
+  current_proc->wait_next = wq->head;
+  wq->head = current_proc;
+  yield();
+}
+
+// wqで待っているプロセスをすべて実行可能に戻す
+void wake_up(struct wait_queue *wq) {
+  struct process *proc = wq->head;
+  while (proc) {
+    struct process *next = proc->wait_next;
+    proc->state = PROC_RUNNABLE;
+    proc->wait_next = NULL;
+    proc = next;
+  }
+  wq->head = NULL;
+}
+
 // sbi_call
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
                        long arg5, long fid, long eid) {
@@ -218,7 +288,11 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
   return (struct sbiret){.error = a0, .value = a1};
 }
 
-void shutdown(void) { sbi_call(0, 0, 0, 0, 0, 0, 0, 8); }
+void shutdown(void) {
+  // 電源を切る前に、開いているファイルとデバイスの書き込みキャッシュを書き出す
+  kfsync();
+  sbi_call(0, 0, 0, 0, 0, 0, 0, 8);
+}
 
 // カーネルのデバッグ用のI/O
 void kputchar(char ch) { sbi_call(ch, 0, 0, 0, 0, 0, 0, 1); }
@@ -307,6 +381,14 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
                        "sret\n");
 }
 
+// [addr, addr+len) が現在のプロセスのユーザー領域に収まっているか。
+// SUMを立てるとカーネルのページにも触れてしまうので、ユーザーが渡した
+// ポインタは使う前に必ず確かめる
+static bool user_range_ok(uint32_t addr, uint32_t len) {
+  uint32_t end = USER_BASE + current_proc->user_size;
+  return addr >= USER_BASE && addr <= end && len <= end - addr;
+}
+
 // sbi legacy extension
 void handle_syscall(struct trap_frame *f) {
   switch (f->a3) {
@@ -365,6 +447,54 @@ void handle_syscall(struct trap_frame *f) {
   case SYS_FPUTC:
     f->a0 = kfputc(f->a0, f->a1);
     break;
+  case SYS_READ: {
+    if (!user_range_ok(f->a1, f->a2)) {
+      f->a0 = -1;
+      break;
+    }
+    uint32_t prev_sstatus = READ_CSR(sstatus);
+    WRITE_CSR(sstatus, prev_sstatus | SSTATUS_SUM);
+    f->a0 = kfread(f->a0, (uint8_t *)f->a1, f->a2);
+    WRITE_CSR(sstatus, prev_sstatus);
+    break;
+  }
+  case SYS_WRITE: {
+    if (!user_range_ok(f->a1, f->a2)) {
+      f->a0 = -1;
+      break;
+    }
+    uint32_t prev_sstatus = READ_CSR(sstatus);
+    WRITE_CSR(sstatus, prev_sstatus | SSTATUS_SUM);
+    f->a0 = kfwrite(f->a0, (const uint8_t *)f->a1, f->a2);
+    WRITE_CSR(sstatus, prev_sstatus);
+    break;
+  }
+  case SYS_LSEEK:
+    f->a0 = kflseek(f->a0, f->a1, f->a2);
+    break;
+  case SYS_PREAD: {
+    if (!user_range_ok(f->a1, f->a2)) {
+      f->a0 = -1;
+      break;
+    }
+    // 4つ目の引数 (オフセット) はa4で渡される
+    uint32_t prev_sstatus = READ_CSR(sstatus);
+    WRITE_CSR(sstatus, prev_sstatus | SSTATUS_SUM);
+    f->a0 = kfpread(f->a0, (uint8_t *)f->a1, f->a2, f->a4);
+    WRITE_CSR(sstatus, prev_sstatus);
+    break;
+  }
+  case SYS_PWRITE: {
+    if (!user_range_ok(f->a1, f->a2)) {
+      f->a0 = -1;
+      break;
+    }
+    uint32_t prev_sstatus = READ_CSR(sstatus);
+    WRITE_CSR(sstatus, prev_sstatus | SSTATUS_SUM);
+    f->a0 = kfpwrite(f->a0, (const uint8_t *)f->a1, f->a2, f->a4);
+    WRITE_CSR(sstatus, prev_sstatus);
+    break;
+  }
   default:
     PANIC("unexpected syscall a3=%x\n", f->a3);
   }
@@ -378,6 +508,10 @@ void handle_trap(struct trap_frame *f) {
   if (scause == SCAUSE_ECALL) {
     handle_syscall(f);
     user_pc += 4;
+  } else if (scause == SCAUSE_S_EXTERNAL) {
+    // I/Oの完了で起きたプロセスがあれば、そちらに切り替える
+    handle_external_interrupt();
+    yield();
   } else {
     PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
           user_pc);
@@ -401,129 +535,260 @@ static bool mode_contains(const char *mode, char token) {
   return false;
 }
 
-static struct dir_entry *find_dir_entry_by_path(const char *path) {
-  for (int i = 0; i < BPB_RootEntCnt; i++) {
-    if (root_dir[i].name[0] == 0x00)
-      break;
-    if (root_dir[i].name[0] == 0xE5)
-      continue;
+// ファイル内で連続しているクラスタの範囲。ファイルのindex番目のクラスタから
+// len個が、ディスク上ではclusterから連続して並んでいる
+struct cluster_extent {
+  uint32_t index;
+  uint32_t cluster;
+  uint32_t len;
+};
 
-    char name[13];
-    int p = 0;
+#define OPEN_FILES_MAX 16
+// ファイル内の位置の上限。lseekなどの戻り値 (int) に収まる範囲に限る
+#define FILE_POSITION_MAX 0x7FFFFFFFu
+// 先読みするセクタ数。順方向に読み進めている間はMINからMAXまで倍々に広げる。
+// クラスタサイズはボリュームごとに違うので、クラスタ数にはその都度換算する
+#define READAHEAD_MIN_SECTORS 8
+#define READAHEAD_MAX_SECTORS 128
+struct open_file {
+  struct dir_entry *entry;
+  uint32_t position;
+  bool used;
+  // 現在位置のクラスタのバッファ。buf_clusterが0なら空。
+  // 1文字ずつの読み書きはここで済ませ、書き戻しはクラスタを移るとき、
+  // close、syncのときにまとめて行う
+  uint32_t buf_cluster;
+  bool buf_dirty;
+  uint8_t *buf; // CLUSTER_SIZEバイト。最初に使うときに確保する
+  // クラスタ単位でまとめて読むときの受け取り先。ユーザーのポインタを
+  // ブロック層に渡さないよう、一度ここに読んでからコピーする
+  uint8_t *run_buf;
+  // クラスタチェーンをファイルの先頭から順にextentにまとめたもの。
+  // たどった所まで作り、チェーンが伸びたら後ろに足す。切り詰めたら作り直す
+  struct cluster_extent *extents;
+  unsigned extent_count;
+  unsigned extent_cap;
+  // 先読みの状態。ra_nextは順方向なら次に読むクラスタ番号、
+  // ra_endは先読みを発行済みの範囲の終わり
+  uint32_t ra_next;
+  uint32_t ra_end;
+  unsigned ra_window;
+};
 
-    for (int j = 0; j < 8; j++) {
-      if (root_dir[i].name[j] != ' ')
-        name[p++] = root_dir[i].name[j];
-    }
+static struct open_file open_files[OPEN_FILES_MAX];
 
-    if (root_dir[i].ext[0] != ' ') {
-      name[p++] = '.';
-      for (int j = 0; j < 3; j++) {
-        if (root_dir[i].ext[j] != ' ')
-          name[p++] = root_dir[i].ext[j];
-      }
-    }
+static int alloc_open_file(void) {
+  for (int i = 0; i < OPEN_FILES_MAX; i++) {
+    if (!open_files[i].used)
+      return i;
+  }
+  return -1;
+}
 
-    name[p] = '\0';
+// extentの配列は1ページから始め、足りなくなったら倍にする。
+// alloc_pagesは解放できないので、大きくした配列はそのスロットで使い回す
+#define EXTENTS_INITIAL (PAGE_SIZE / sizeof(struct cluster_extent))
+
+// チェーンの次のクラスタを末尾に足す。直前のextentと連続していればまとめる
+static void extent_append(struct open_file *of, uint32_t cluster) {
+  uint32_t index = 0;
+  if (of->extent_count > 0) {
+    struct cluster_extent *last = &of->extents[of->extent_count - 1];
+    if (last->cluster + last->len == cluster) {
+      last->len++;
+      return;
+    }
+    index = last->index + last->len;
+  }
 
-    if (strcmp(name, path) == 0)
-      return &root_dir[i];
+  if (of->extent_count == of->extent_cap) {
+    unsigned cap = of->extent_cap ? of->extent_cap * 2 : EXTENTS_INITIAL;
+    struct cluster_extent *extents = (struct cluster_extent *)alloc_pages(
+        align_up(cap * sizeof(struct cluster_extent), PAGE_SIZE) / PAGE_SIZE);
+    memcpy(extents, of->extents,
+           of->extent_count * sizeof(struct cluster_extent));
+    of->extents = extents;
+    of->extent_cap = cap;
   }
 
-  return NULL;
+  struct cluster_extent *e = &of->extents[of->extent_count++];
+  e->index = index;
+  e->cluster = cluster;
+  e->len = 1;
 }
 
-static uint16_t find_free_cluster(void) {
-  for (uint16_t i = 2; i < FAT_ENTRY_NUM; i++) {
-    if (fat[i] == 0x0000)
-      return i;
+// ファイル内のindex番目のクラスタを含むextentを返す。まだ載っていなければ
+// チェーンをたどって足す。チェーンがそこまでなければNULLを返す
+static struct cluster_extent *extent_lookup(struct open_file *of,
+                                            uint32_t index) {
+  if (of->extent_count == 0) {
+    uint32_t start = dir_entry_cluster(of->entry);
+    if (!fat_cluster_valid(start))
+      return NULL;
+    extent_append(of, start);
   }
-  return 0;
+
+  struct cluster_extent *last = &of->extents[of->extent_count - 1];
+  while (index >= last->index + last->len) {
+    uint32_t next = get_fat_entry(last->cluster + last->len - 1);
+    if (!fat_cluster_valid(next))
+      return NULL;
+    extent_append(of, next);
+    last = &of->extents[of->extent_count - 1];
+  }
+
+  // indexを含むextentを二分探索する
+  unsigned lo = 0, hi = of->extent_count - 1;
+  while (lo < hi) {
+    unsigned mid = (lo + hi + 1) / 2;
+    if (of->extents[mid].index <= index)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &of->extents[lo];
 }
 
-static int locate_cluster_for_offset(uint16_t start_cluster, uint32_t offset,
-                                     uint16_t *cluster_out,
-                                     uint32_t *offset_in_cluster) {
-  if (!cluster_out || !offset_in_cluster)
-    return -1;
-  if (start_cluster < 2 || start_cluster >= FAT_ENTRY_NUM)
+static int locate_cluster(struct open_file *of, uint32_t index,
+                          uint32_t *cluster) {
+  struct cluster_extent *e = extent_lookup(of, index);
+  if (!e)
     return -1;
+  *cluster = e->cluster + (index - e->index);
+  return 0;
+}
 
-  uint16_t cluster = start_cluster;
-  uint32_t remaining = offset;
+// index番目のクラスタを返す。チェーンが足りなければ末尾から足りない分を
+// まとめて確保する。*is_newは返したクラスタを今確保したかどうか
+static int ensure_cluster(struct open_file *of, uint32_t index,
+                          uint32_t *cluster, bool *is_new) {
+  uint32_t start = dir_entry_cluster(of->entry);
+  if (!fat_cluster_valid(start))
+    return -1;
 
-  while (remaining >= CLUSTER_SIZE) {
-    uint16_t next = fat[cluster];
-    if (next == 0x0000 || next == 0xFFFF || next >= FAT_ENTRY_NUM)
-      return -1;
-    cluster = next;
-    remaining -= CLUSTER_SIZE;
+  *is_new = false;
+  if (get_fat_entry(start) == FAT_FREE) {
+    set_fat_entry(start, FAT_EOC);
+    *is_new = index == 0;
   }
 
-  *cluster_out = cluster;
-  *offset_in_cluster = remaining;
-  return 0;
-}
+  if (locate_cluster(of, index, cluster) == 0)
+    return 0;
 
-static int ensure_cluster_for_offset(uint16_t start_cluster, uint32_t offset,
-                                     uint16_t *cluster_out,
-                                     uint32_t *offset_in_cluster,
-                                     bool *target_is_new) {
-  if (!cluster_out || !offset_in_cluster)
+  // 足りない分をまとめて (できるだけ連続して) 確保する
+  struct cluster_extent *last = &of->extents[of->extent_count - 1];
+  uint32_t end = last->index + last->len;
+  if (alloc_cluster_chain(last->cluster + last->len - 1, index + 1 - end) == 0)
     return -1;
-  if (start_cluster < 2 || start_cluster >= FAT_ENTRY_NUM)
+  if (locate_cluster(of, index, cluster) < 0)
     return -1;
 
-  bool cluster_new = false;
-  if (fat[start_cluster] == 0x0000) {
-    fat[start_cluster] = 0xFFFF;
-    cluster_new = true;
+  // ファイルの終わりより先に書き込むと、間のクラスタは書き込まれないまま
+  // 残るので0で埋めておく
+  for (uint32_t i = end; i < index;) {
+    struct cluster_extent *e = extent_lookup(of, i);
+    uint32_t n = e->index + e->len - i;
+    if (n > index - i)
+      n = index - i;
+    zero_clusters(e->cluster + (i - e->index), n);
+    i += n;
   }
+  *is_new = true;
+  return 0;
+}
 
-  uint16_t cluster = start_cluster;
-  uint32_t remaining = offset;
-
-  while (remaining >= CLUSTER_SIZE) {
-    uint16_t next = fat[cluster];
-    bool allocated = false;
+// バッファの変更を、FATとルートディレクトリの変更と一緒に書き戻す
+static int flush_open_file(struct open_file *of) {
+  if (!of->buf_dirty)
+    return 0;
 
-    if (next == 0x0000 || next == 0xFFFF || next >= FAT_ENTRY_NUM) {
-      next = find_free_cluster();
-      if (next == 0)
-        return -1;
-      fat[cluster] = next;
-      fat[next] = 0xFFFF;
-      allocated = true;
-    }
+  blk_plug();
+  write_cluster(of->buf_cluster, of->buf);
+  write_fat_to_disk();
+  write_root_dir_to_disk();
+  of->buf_dirty = false;
+  return blk_unplug();
+}
 
-    cluster = next;
-    remaining -= CLUSTER_SIZE;
-    cluster_new = allocated;
+// clusterを他のファイルディスクリプタがバッファしていれば、書き戻して捨てる
+static int release_cluster_buffers(struct open_file *self, uint32_t cluster) {
+  int ret = 0;
+  for (int i = 0; i < OPEN_FILES_MAX; i++) {
+    struct open_file *of = &open_files[i];
+    if (of == self || !of->used || of->buf_cluster != cluster)
+      continue;
+    if (flush_open_file(of) < 0)
+      ret = -1;
+    of->buf_cluster = 0;
   }
+  return ret;
+}
 
-  if (target_is_new)
-    *target_is_new = cluster_new;
+// clusterをバッファに載せる。is_newなら確保したばかりなので読まずに0埋めする
+static int load_cluster(struct open_file *of, uint32_t cluster, bool is_new) {
+  if (of->buf_cluster == cluster)
+    return 0;
+  if (flush_open_file(of) < 0)
+    return -1;
+  if (release_cluster_buffers(of, cluster) < 0)
+    return -1;
 
-  *cluster_out = cluster;
-  *offset_in_cluster = remaining;
+  if (is_new)
+    memset(of->buf, 0, CLUSTER_SIZE);
+  else
+    read_cluster(cluster, of->buf);
+  of->buf_cluster = cluster;
   return 0;
 }
 
-#define OPEN_FILES_MAX 16
-struct open_file {
-  struct dir_entry *entry;
-  uint32_t position;
-  bool used;
-};
+// ファイル内のindex番目のクラスタ (物理クラスタはcluster) を読み始めるときに
+// 呼ぶ。順方向の読み込みが続いていれば先読みの幅を広げ、先読みした分が
+// 幅の半分を切ったら続きを発行する
+static unsigned readahead_clusters(unsigned sectors) {
+  unsigned n = sectors / fat16_geo.sec_per_clus;
+  return n > 0 ? n : 1;
+}
 
-static struct open_file open_files[OPEN_FILES_MAX];
+static void readahead(struct open_file *of, uint32_t index) {
+  if (index != of->ra_next) {
+    of->ra_window = 0;
+    of->ra_next = of->ra_end = index + 1;
+    return;
+  }
 
-static int alloc_open_file(void) {
+  of->ra_next = index + 1;
+  if (of->ra_window == 0)
+    of->ra_window = readahead_clusters(READAHEAD_MIN_SECTORS);
+  else if (of->ra_window < readahead_clusters(READAHEAD_MAX_SECTORS))
+    of->ra_window *= 2;
+
+  uint32_t from = of->ra_end > index + 1 ? of->ra_end : index + 1;
+  if (from - (index + 1) >= of->ra_window / 2)
+    return;
+
+  uint32_t end = index + 1 + of->ra_window;
+  uint32_t last = (of->entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  if (end > last)
+    end = last;
+  if (from >= end)
+    return;
+
+  uint32_t cluster;
+  if (locate_cluster(of, from, &cluster) < 0)
+    return;
+  fat16_readahead(cluster, end - from);
+  of->ra_end = end;
+}
+
+static int kfsync(void) {
+  int ret = 0;
   for (int i = 0; i < OPEN_FILES_MAX; i++) {
-    if (!open_files[i].used)
-      return i;
+    if (open_files[i].used && flush_open_file(&open_files[i]) < 0)
+      ret = -1;
   }
-  return -1;
+  if (fat16_sync() < 0)
+    ret = -1;
+  return ret;
 }
 
 static int kfopen(const char *path, const char *mode) {
@@ -534,16 +799,12 @@ static int kfopen(const char *path, const char *mode) {
   bool want_append = mode_contains(mode, 'a');
   bool want_create = want_write || want_append;
 
-  read_fat_from_disk();
-  read_root_dir_from_disk();
-
   struct dir_entry *target = find_dir_entry_by_path(path);
 
   if (!target && want_create) {
     if (create_file(path, NULL, 0) < 0)
       return -1;
 
-    read_root_dir_from_disk();
     target = find_dir_entry_by_path(path);
   }
 
@@ -551,11 +812,19 @@ static int kfopen(const char *path, const char *mode) {
     return -1;
 
   if (want_write) {
-    if (write_file(target->start_cluster, NULL, 0) < 0)
-      return -1;
-    read_root_dir_from_disk();
-    target = find_dir_entry_by_path(path);
-    if (!target)
+    // 切り詰めで解放されるクラスタを他のディスクリプタが持っていないように、
+    // 同じファイルのバッファは書き戻して捨てておく
+    for (int i = 0; i < OPEN_FILES_MAX; i++) {
+      struct open_file *of = &open_files[i];
+      if (!of->used || of->entry != target)
+        continue;
+      if (flush_open_file(of) < 0)
+        return -1;
+      of->buf_cluster = 0;
+      of->extent_count = 0;
+      of->ra_next = of->ra_end = of->ra_window = 0;
+    }
+    if (write_file(dir_entry_cluster(target), NULL, 0) < 0)
       return -1;
   }
 
@@ -563,9 +832,20 @@ static int kfopen(const char *path, const char *mode) {
   if (slot < 0)
     return -1;
 
+  // クラスタサイズはマウント後は変わらないので、一度確保したら使い回す
+  if (!open_files[slot].buf)
+    open_files[slot].buf = (uint8_t *)alloc_pages(
+        align_up(CLUSTER_SIZE, PAGE_SIZE) / PAGE_SIZE);
+
   open_files[slot].used = true;
   open_files[slot].entry = target;
   open_files[slot].position = want_append ? target->size : 0;
+  open_files[slot].buf_cluster = 0;
+  open_files[slot].buf_dirty = false;
+  open_files[slot].extent_count = 0;
+  open_files[slot].ra_next = 0;
+  open_files[slot].ra_end = 0;
+  open_files[slot].ra_window = 0;
   return slot;
 }
 
@@ -573,70 +853,222 @@ static int kfclose(int fd) {
   if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used)
     return -1;
 
+  // バッファ、FAT、ディレクトリはデバイスに書き出すが、書き込みキャッシュの
+  // FLUSHはしない。永続化はsync/shutdown (kfsync) でまとめて行う
+  int ret = flush_open_file(&open_files[fd]);
+  blk_plug();
+  write_fat_to_disk();
+  write_root_dir_to_disk();
+  if (blk_unplug() < 0)
+    ret = -1;
   open_files[fd].used = false;
   open_files[fd].entry = NULL;
   open_files[fd].position = 0;
-  return 0;
+  open_files[fd].buf_cluster = 0;
+  return ret;
 }
 
-static int kfputc(int fd, int ch) {
-  if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used)
+// bufのnバイトを現在位置に書き込む。書き込んだバイト数を返す
+static int kfwrite(int fd, const uint8_t *buf, uint32_t n) {
+  if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used || !buf)
     return -1;
 
-  read_fat_from_disk();
-  read_root_dir_from_disk();
+  struct open_file *of = &open_files[fd];
+  struct dir_entry *entry = of->entry;
+  uint32_t done = 0;
+
+  // 位置がFILE_POSITION_MAXを超えないところまでしか書かない
+  if (of->position >= FILE_POSITION_MAX)
+    return n > 0 ? -1 : 0;
+  if (n > FILE_POSITION_MAX - of->position)
+    n = FILE_POSITION_MAX - of->position;
+
+  while (done < n) {
+    uint32_t cluster;
+    uint32_t offset_in_cluster = of->position % CLUSTER_SIZE;
+    bool target_is_new;
+
+    if (ensure_cluster(of, of->position / CLUSTER_SIZE, &cluster,
+                       &target_is_new) < 0)
+      break;
+    if (load_cluster(of, cluster, target_is_new) < 0)
+      break;
 
-  struct dir_entry *entry = open_files[fd].entry;
+    // 書き込みはバッファだけで済ませる。load_clusterで他のディスクリプタの
+    // 同じクラスタのバッファは捨ててあるので、古い内容が読まれることはない
+    uint32_t chunk = CLUSTER_SIZE - offset_in_cluster;
+    if (chunk > n - done)
+      chunk = n - done;
+    memcpy(of->buf + offset_in_cluster, buf + done, chunk);
+    of->buf_dirty = true;
+
+    of->position += chunk;
+    done += chunk;
+    if (of->position > entry->size) {
+      entry->size = of->position;
+      mark_dir_entry_dirty(entry);
+    }
+  }
 
-  uint16_t cluster;
-  uint32_t offset_in_cluster;
-  bool target_is_new = false;
+  if (done == 0 && n > 0)
+    return -1;
+  return done;
+}
 
-  if (ensure_cluster_for_offset(entry->start_cluster, open_files[fd].position,
-                                &cluster, &offset_in_cluster,
-                                &target_is_new) < 0)
+// 現在位置から最大nバイトをbufに読み込む。読んだバイト数を返し、
+// ファイルの終わりでは0を返す
+static int kfread(int fd, uint8_t *buf, uint32_t n) {
+  if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used || !buf)
     return -1;
 
-  uint8_t cluster_buf[CLUSTER_SIZE];
-  if (target_is_new)
-    memset(cluster_buf, 0, sizeof(cluster_buf));
-  else
-    read_cluster(cluster, cluster_buf);
+  struct open_file *of = &open_files[fd];
+  struct dir_entry *entry = of->entry;
+  if (of->position >= entry->size)
+    return 0;
+  if (n > entry->size - of->position)
+    n = entry->size - of->position;
+
+  uint32_t done = 0;
+  while (done < n) {
+    uint32_t index = of->position / CLUSTER_SIZE;
+    uint32_t offset_in_cluster = of->position % CLUSTER_SIZE;
+    struct cluster_extent *e = extent_lookup(of, index);
+    if (!e)
+      break;
+    uint32_t cluster = e->cluster + (index - e->index);
+
+    // クラスタ境界から1クラスタ以上読むときは、ディスク上で連続している
+    // 範囲をクラスタごとのバッファを通さずに1リクエストで読む
+    uint32_t run = (n - done) / CLUSTER_SIZE;
+    if (offset_in_cluster == 0 && run > 0) {
+      if (run > e->index + e->len - index)
+        run = e->index + e->len - index;
+      if (run > VIRTIO_BLK_MAX_SECTORS / fat16_geo.sec_per_clus)
+        run = VIRTIO_BLK_MAX_SECTORS / fat16_geo.sec_per_clus;
+      if (run == 0)
+        run = 1;
+
+      // バッファにある未書き込みの変更を先にディスクに反映させる
+      int ret = flush_open_file(of);
+      for (uint32_t i = 0; i < run; i++) {
+        if (release_cluster_buffers(of, cluster + i) < 0)
+          ret = -1;
+      }
+      if (ret < 0)
+        break;
 
-  cluster_buf[offset_in_cluster] = (uint8_t)ch;
-  write_cluster(cluster, cluster_buf);
+      // 範囲の最後のクラスタを読み始めたものとして先読みを進める
+      if (of->ra_next == index)
+        of->ra_next = index + run - 1;
+      readahead(of, index + run - 1);
+      // 完了は別のプロセス (ユーザー領域をマッピングしていない) で処理される
+      // ことがあるので、カーネルのバッファに読んでから呼び出し元でコピーする
+      if (!of->run_buf) {
+        uint32_t size = VIRTIO_BLK_MAX_SECTORS * SECTOR_SIZE;
+        if (size < CLUSTER_SIZE)
+          size = CLUSTER_SIZE;
+        of->run_buf =
+            (uint8_t *)alloc_pages(align_up(size, PAGE_SIZE) / PAGE_SIZE);
+      }
+      if (read_clusters(cluster, run, of->run_buf) < 0)
+        break;
+      memcpy(buf + done, of->run_buf, run * CLUSTER_SIZE);
 
-  open_files[fd].position += 1;
-  if (open_files[fd].position > entry->size)
-    entry->size = open_files[fd].position;
+      of->position += run * CLUSTER_SIZE;
+      done += run * CLUSTER_SIZE;
+      continue;
+    }
 
-  write_fat_to_disk();
-  write_root_dir_to_disk();
+    if (cluster != of->buf_cluster)
+      readahead(of, index);
+    if (load_cluster(of, cluster, false) < 0)
+      break;
+
+    uint32_t chunk = CLUSTER_SIZE - offset_in_cluster;
+    if (chunk > n - done)
+      chunk = n - done;
+    memcpy(buf + done, of->buf + offset_in_cluster, chunk);
+
+    of->position += chunk;
+    done += chunk;
+  }
 
-  return ch & 0xff;
+  if (done == 0 && n > 0)
+    return -1;
+  return done;
 }
 
-static int kfgetc(int fd) {
+// 現在位置をwhenceからoffsetバイトの位置に移し、新しい位置を返す。
+// ファイルの終わりより先にも移せる (そこに書き込むと間は0で埋まる)
+static int kflseek(int fd, int offset, int whence) {
   if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used)
-    return EOF;
+    return -1;
 
-  struct dir_entry *entry = open_files[fd].entry;
-  if (open_files[fd].position >= entry->size)
-    return EOF;
+  struct open_file *of = &open_files[fd];
+  uint32_t base;
+  switch (whence) {
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = of->position;
+    break;
+  case SEEK_END:
+    base = of->entry->size;
+    break;
+  default:
+    return -1;
+  }
 
-  read_fat_from_disk();
+  // 負の位置や、戻り値 (int) に収まらない位置には移せない
+  if (base > FILE_POSITION_MAX)
+    return -1;
+  if (offset < 0 ? 0u - (uint32_t)offset > base
+                 : (uint32_t)offset > FILE_POSITION_MAX - base)
+    return -1;
+  of->position = base + offset;
+  return of->position;
+}
 
-  uint16_t cluster;
-  uint32_t offset_in_cluster;
-  if (locate_cluster_for_offset(entry->start_cluster, open_files[fd].position,
-                                &cluster, &offset_in_cluster) < 0)
-    return EOF;
+// offsetの位置から読み書きする。現在位置は変えない
+static int kfpread(int fd, uint8_t *buf, uint32_t n, uint32_t offset) {
+  if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used ||
+      offset > FILE_POSITION_MAX)
+    return -1;
+
+  struct open_file *of = &open_files[fd];
+  uint32_t position = of->position;
+  of->position = offset;
+  int ret = kfread(fd, buf, n);
+  of->position = position;
+  return ret;
+}
 
-  uint8_t cluster_buf[CLUSTER_SIZE];
-  read_cluster(cluster, cluster_buf);
+static int kfpwrite(int fd, const uint8_t *buf, uint32_t n, uint32_t offset) {
+  if (fd < 0 || fd >= OPEN_FILES_MAX || !open_files[fd].used ||
+      offset > FILE_POSITION_MAX)
+    return -1;
+
+  struct open_file *of = &open_files[fd];
+  uint32_t position = of->position;
+  of->position = offset;
+  int ret = kfwrite(fd, buf, n);
+  of->position = position;
+  return ret;
+}
+
+static int kfputc(int fd, int ch) {
+  uint8_t c = (uint8_t)ch;
+  if (kfwrite(fd, &c, 1) != 1)
+    return -1;
+  return c;
+}
 
-  open_files[fd].position += 1;
-  return cluster_buf[offset_in_cluster];
+static int kfgetc(int fd) {
+  uint8_t c;
+  if (kfread(fd, &c, 1) != 1)
+    return EOF;
+  return c;
 }
 
 // process_switch_test
@@ -677,8 +1109,25 @@ __attribute__((section(".text.boot"))) __attribute__((naked)) void boot(void) {
 void kernel_main(void) {
   memset(__bss, 0, (size_t)__bss_end - (size_t)__bss);
   WRITE_CSR(stvec, (uint32_t)kernel_entry);
+  plic_init();
   virtio_blk_init();
-  init_fat16_disk();
+  blk_init();
+  bcache_init();
+#ifdef BLK_BENCH
+  virtio_blk_bench();
+  shutdown();
+#endif
+  // ディスク上の有効なボリュームはそのまま使い、なければフォーマットする。
+  // 扱えないだけのFATボリュームは、ユーザーのデータを消さないように止まる
+  bool formatted = false;
+  int mounted = FAT16_FORMAT ? FAT_MOUNT_NONE : fat16_mount();
+  if (mounted == FAT_MOUNT_UNSUPPORTED)
+    PANIC("unsupported FAT volume; rebuild with FORMAT=1 to reformat it");
+  if (mounted < 0) {
+    printf("[FAT] formatting\n");
+    init_fat16_disk();
+    formatted = true;
+  }
 
   idle_proc = create_process(NULL, 0);
   idle_proc->pid = 0;
@@ -689,18 +1138,29 @@ void kernel_main(void) {
   char buf[SECTOR_SIZE];
   read_write_disk(buf, 0, false);
   printf("first sector: %s\n", buf);
-  create_file("test.txt", (uint8_t *)"hello", 5);
-  create_file("test2.txt", (uint8_t *)"hello2", 6);
-
-  int fd = kfopen("test.txt", "a");
-  char *msg = " world!";
-  for (int i = 0; msg[i] != '\0'; i++) {
-    kfputc(fd, msg[i]);
+  // サンプルのファイルはフォーマットしたときだけ作る
+  if (formatted) {
+    create_file("test.txt", (uint8_t *)"hello", 5);
+    create_file("test2.txt", (uint8_t *)"hello2", 6);
+
+    int fd = kfopen("test.txt", "a");
+    char *msg = " world!";
+    for (int i = 0; msg[i] != '\0'; i++) {
+      kfputc(fd, msg[i]);
+    }
+    kfclose(fd);
   }
-  kfclose(fd);
 
   create_process(_binary_shell_bin_start, (size_t)_binary_shell_bin_size);
-  yield();
+
+  // アイドルループ: 実行できるプロセスがなくなるとここに戻ってくる。
+  // I/O待ちのプロセスが残っていれば、割り込みで起きるまで待つ
+  while (true) {
+    yield();
+    if (!has_blocked_process())
+      break;
+    wait_for_interrupt();
+  }
   shutdown();
   PANIC("shell discontinued");
 
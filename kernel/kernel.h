@@ -67,15 +67,23 @@ struct trap_frame {
 #define PROC_UNUSED 0
 #define PROC_RUNNABLE 1
 #define PROC_EXITED 2
+#define PROC_BLOCKED 3 // wait_queueで待っている
 
 struct process {
   int pid;
   int state;
   vaddr_t sp;
   uint32_t *page_table;
+  uint32_t user_size;        // USER_BASEからマッピングしたユーザー領域の大きさ
+  struct process *wait_next; // 同じwait_queueで待つ次のプロセス
   uint8_t stack[8192];
 };
 
+// イベントを待つプロセスのリスト
+struct wait_queue {
+  struct process *head;
+};
+
 #define SATP_SV32 (1u << 31)
 #define PAGE_V (1 << 0) // 有効化ビット
 #define PAGE_R (1 << 1) // 読み込み可能
@@ -88,11 +96,17 @@ struct process {
 #define SSTATUS_SPIE (1 << 5)
 #define SSTATUS_SUM (1 << 18)
 #define SCAUSE_ECALL 8
+#define SCAUSE_INTERRUPT (1u << 31)
+#define SCAUSE_S_EXTERNAL (SCAUSE_INTERRUPT | 9)
+#define SIE_SEIE (1 << 9)
 
 #define SYSTEM_RESET_SBICALL 0x53525354
 #define RESET_TYPE_SHUTDOWN 0
 #define RESET_REASON_NONE 0
 
 paddr_t alloc_pages(uint32_t n);
+void yield(void);
+void sleep_on(struct wait_queue *wq);
+void wake_up(struct wait_queue *wq);
 
 #endif
@@ -0,0 +1,29 @@
+#include "plic.h"
+#include "kernel.h"
+
+static uint32_t plic_read32(paddr_t addr) {
+  return *((volatile uint32_t *)addr);
+}
+
+static void plic_write32(paddr_t addr, uint32_t value) {
+  *((volatile uint32_t *)addr) = value;
+}
+
+void plic_init(void) {
+  // 優先度が0より大きい割り込みはすべて受け付ける
+  plic_write32(PLIC_STHRESHOLD, 0);
+  // Sモードの外部割り込みを有効にする。カーネル内ではsstatus.SIEを立てないので、
+  // 割り込みはユーザーモード実行中かwfiで待っている間にだけ届く
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+void plic_enable(unsigned irq) {
+  plic_write32(PLIC_PRIORITY(irq), 1);
+  plic_write32(PLIC_SENABLE + (irq / 32) * 4,
+               plic_read32(PLIC_SENABLE + (irq / 32) * 4) | (1u << (irq % 32)));
+}
+
+// 処理すべき割り込み番号を取得する。なければ0
+unsigned plic_claim(void) { return plic_read32(PLIC_SCLAIM); }
+
+void plic_complete(unsigned irq) { plic_write32(PLIC_SCLAIM, irq); }
@@ -0,0 +1,20 @@
+#ifndef PLIC_H
+#define PLIC_H
+// QEMU virt マシンの PLIC (Platform-Level Interrupt Controller)
+
+#include "kernel_defs.h"
+
+#define PLIC_PADDR 0x0c000000
+// hart 0 の S モードはコンテキスト1
+#define PLIC_CONTEXT 1
+#define PLIC_PRIORITY(irq) (PLIC_PADDR + (irq) * 4)
+#define PLIC_SENABLE (PLIC_PADDR + 0x2000 + PLIC_CONTEXT * 0x80)
+#define PLIC_STHRESHOLD (PLIC_PADDR + 0x200000 + PLIC_CONTEXT * 0x1000)
+#define PLIC_SCLAIM (PLIC_STHRESHOLD + 4)
+
+void plic_init(void);
+void plic_enable(unsigned irq);
+unsigned plic_claim(void);
+void plic_complete(unsigned irq);
+
+#endif
@@ -1,15 +1,44 @@
 #include "virtio.h"
 #include "kernel.h"
+#include "plic.h"
+
+extern char __kernel_base[], __free_ram_end[];
 
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
+struct virtio_blk_req *blk_reqs; // リクエストスロットのプール
+paddr_t blk_reqs_paddr;
 uint64_t blk_capacity;
+uint64_t blk_features; // デバイスと合意した機能ビット
+// DISCARD / WRITE_ZEROESの1リクエストで扱えるセクタ数
+static uint32_t blk_max_discard_sectors;
+static uint32_t blk_max_write_zeroes_sectors;
+static bool blk_write_zeroes_may_unmap;
+static uint32_t virtio_version;
+static int blk_plug_depth;
+
+// 各スロットの状態 (デバイスには見せない)
+struct blk_req_slot {
+  bool used;
+  struct virtio_blk_io *io;
+  struct virtio_blk_seg segs[VIRTIO_BLK_SEG_MAX];
+  int bounce_offset[VIRTIO_BLK_SEG_MAX]; // バウンスしない場合は-1
+  int nsegs;
+  int is_write;
+};
+
+// スロット番号をそのままバッファIDとしてデバイスに渡す
+static struct blk_req_slot blk_slots[VIRTIO_BLK_REQ_MAX];
+// リクエストの完了 (またはスロットの空き) を待つプロセス
+static struct wait_queue blk_wait_queue;
 
 uint32_t virtio_reg_read32(unsigned offset) {
   return *((volatile uint32_t *)(VIRTIO_BLK_PADDR + offset));
 }
 
+uint8_t virtio_reg_read8(unsigned offset) {
+  return *((volatile uint8_t *)(VIRTIO_BLK_PADDR + offset));
+}
+
 uint64_t virtio_reg_read64(unsigned offset) {
   return *((volatile uint64_t *)(VIRTIO_BLK_PADDR + offset));
 }
@@ -18,33 +47,106 @@ void virtio_reg_write32(unsigned offset, uint32_t value) {
   *((volatile uint32_t *)(VIRTIO_BLK_PADDR + offset)) = value;
 }
 
+void virtio_reg_write8(unsigned offset, uint8_t value) {
+  *((volatile uint8_t *)(VIRTIO_BLK_PADDR + offset)) = value;
+}
+
 void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value) {
   virtio_reg_write32(offset, virtio_reg_read32(offset) | value);
 }
 
+static bool has_feature(unsigned bit) { return (blk_features >> bit) & 1; }
+
+static uint64_t virtio_read_device_features(void) {
+  virtio_reg_write32(VIRTIO_REG_DEVICE_FEATURES_SEL, 0);
+  uint64_t low = virtio_reg_read32(VIRTIO_REG_DEVICE_FEATURES);
+  // legacyデバイスは32ビット分の機能しか持たない
+  if (virtio_version == 1)
+    return low;
+  virtio_reg_write32(VIRTIO_REG_DEVICE_FEATURES_SEL, 1);
+  uint64_t high = virtio_reg_read32(VIRTIO_REG_DEVICE_FEATURES);
+  return (high << 32) | low;
+}
+
+static void virtio_write_driver_features(uint64_t features) {
+  virtio_reg_write32(VIRTIO_REG_DRIVER_FEATURES_SEL, 0);
+  virtio_reg_write32(VIRTIO_REG_DRIVER_FEATURES, (uint32_t)features);
+  if (virtio_version == 1)
+    return;
+  virtio_reg_write32(VIRTIO_REG_DRIVER_FEATURES_SEL, 1);
+  virtio_reg_write32(VIRTIO_REG_DRIVER_FEATURES, (uint32_t)(features >> 32));
+}
+
 struct virtio_virtq *virtq_init(unsigned index) {
   paddr_t virtq_paddr =
       alloc_pages(align_up(sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE);
   struct virtio_virtq *vq = (struct virtio_virtq *)virtq_paddr;
   vq->queue_index = index;
   vq->used_index = (volatile uint16_t *)&vq->used.index;
+  vq->event_idx = has_feature(VIRTIO_RING_F_EVENT_IDX);
+  vq->indirect = has_feature(VIRTIO_RING_F_INDIRECT_DESC);
+  vq->is_packed = has_feature(VIRTIO_F_RING_PACKED);
+  vq->num_free = VIRTQ_ENTRY_NUM;
+  if (vq->is_packed) {
+    // packed: リングの先頭から順に使う。ラップカウンタは1から始まる
+    vq->next_avail = 0;
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->packed.driver_event.off_wrap = 1 << 15;
+    vq->packed.driver_event.flags =
+        vq->event_idx ? VIRTQ_EVENT_F_DESC : VIRTQ_EVENT_F_ENABLE;
+  } else {
+    // 全ディスクリプタを空きリストにつなぐ
+    for (int i = 0; i < VIRTQ_ENTRY_NUM - 1; i++)
+      vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+  }
   // 1. Select the queue writing its index (first queue is 0) to QueueSel.
   virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
+  // 3. Read maximum queue size (number of elements) from QueueNumMax.
+  if (virtio_reg_read32(VIRTIO_REG_QUEUE_NUM_MAX) < VIRTQ_ENTRY_NUM)
+    PANIC("virtio: queue %d is too small", index);
   // 5. Notify the device about the queue size by writing the size to QueueNum.
   virtio_reg_write32(VIRTIO_REG_QUEUE_NUM, VIRTQ_ENTRY_NUM);
-  // 6. Notify the device about the used alignment by writing its value in bytes
-  // to QueueAlign.
-  virtio_reg_write32(VIRTIO_REG_QUEUE_ALIGN, 0);
-  // 7. Write the physical number of the first page of the queue to the QueuePFN
-  // register.
-  virtio_reg_write32(VIRTIO_REG_QUEUE_PFN, virtq_paddr);
+
+  if (virtio_version == 1) {
+    // 6. Notify the device about the used alignment by writing its value in
+    // bytes to QueueAlign.
+    virtio_reg_write32(VIRTIO_REG_QUEUE_ALIGN, 0);
+    // 7. Write the physical number of the first page of the queue to the
+    // QueuePFN register.
+    virtio_reg_write32(VIRTIO_REG_QUEUE_PFN, virtq_paddr);
+    return vq;
+  }
+
+  // modern: ディスクリプタテーブル、availリング、usedリングの物理アドレスを
+  // それぞれ書き込み、QueueReadyで使用開始を伝える。packedではリングと
+  // ドライバ/デバイスのイベント抑制構造体を渡す
+  paddr_t desc_paddr = virtq_paddr + offsetof(struct virtio_virtq, descs);
+  paddr_t driver_paddr = virtq_paddr + offsetof(struct virtio_virtq, avail);
+  paddr_t device_paddr = virtq_paddr + offsetof(struct virtio_virtq, used);
+  if (vq->is_packed) {
+    desc_paddr = virtq_paddr + offsetof(struct virtio_virtq, packed.ring);
+    driver_paddr =
+        virtq_paddr + offsetof(struct virtio_virtq, packed.driver_event);
+    device_paddr =
+        virtq_paddr + offsetof(struct virtio_virtq, packed.device_event);
+  }
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DESC_LOW, desc_paddr);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DESC_HIGH, 0);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DRIVER_LOW, driver_paddr);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DRIVER_HIGH, 0);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DEVICE_LOW, device_paddr);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_DEVICE_HIGH, 0);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_READY, 1);
   return vq;
 }
 
 void virtio_blk_init(void) {
   if (virtio_reg_read32(VIRTIO_REG_MAGIC) != 0x74726976)
     PANIC("virtio: invalid magic value");
-  if (virtio_reg_read32(VIRTIO_REG_VERSION) != 1)
+  virtio_version = virtio_reg_read32(VIRTIO_REG_VERSION);
+  if (virtio_version != 1 && virtio_version != 2)
     PANIC("virtio: invalid version");
   if (virtio_reg_read32(VIRTIO_REG_DEVICE_ID) != VIRTIO_DEVICE_BLK)
     PANIC("virtio: invalid device id");
@@ -55,81 +157,598 @@ void virtio_blk_init(void) {
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
   // 3. Set the DRIVER status bit.
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+  // 4. Read device feature bits, and write the subset of feature bits
+  // understood by the OS and driver to the device.
+  // packed virtqueueはVERSION_1が前提なので、modernのときだけ使う
+  uint64_t wanted =
+      (1ull << VIRTIO_RING_F_EVENT_IDX) | (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+      (1ull << VIRTIO_BLK_F_FLUSH) | (1ull << VIRTIO_BLK_F_CONFIG_WCE) |
+      (1ull << VIRTIO_BLK_F_DISCARD) | (1ull << VIRTIO_BLK_F_WRITE_ZEROES);
+  if (virtio_version == 2)
+    wanted |= (1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_F_RING_PACKED);
+  blk_features = virtio_read_device_features() & wanted;
+  virtio_write_driver_features(blk_features);
   // 5. Set the FEATURES_OK status bit.
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
+  // 6. Re-read device status to ensure the FEATURES_OK bit is still set.
+  if (virtio_version == 2 &&
+      !(virtio_reg_read32(VIRTIO_REG_DEVICE_STATUS) & VIRTIO_STATUS_FEAT_OK))
+    PANIC("virtio: device did not accept features");
   // 7. Perform device-specific setup, including discovery of virtqueues for the
   // device
   blk_request_vq = virtq_init(0);
   // 8. Set the DRIVER_OK status bit.
-  virtio_reg_write32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
+  virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
 
   // ディスクの容量を取得
-  blk_capacity = virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + 0) * SECTOR_SIZE;
+  blk_capacity =
+      virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY) *
+      SECTOR_SIZE;
   printf("virtio-blk: capacity is %llu bytes\n", blk_capacity);
+  printf("virtio-blk: using %s virtqueue\n",
+         blk_request_vq->is_packed ? "packed" : "split");
+
+  // FLUSHで永続化の順序を制御できるなら、書き込みキャッシュを有効にする。
+  // 書き込みはホストのページキャッシュに入った時点で完了する
+  if (has_feature(VIRTIO_BLK_F_FLUSH) &&
+      has_feature(VIRTIO_BLK_F_CONFIG_WCE))
+    virtio_reg_write8(VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CONFIG_WRITEBACK,
+                      1);
+
+  if (has_feature(VIRTIO_BLK_F_DISCARD))
+    blk_max_discard_sectors = virtio_reg_read32(
+        VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CONFIG_MAX_DISCARD_SECTORS);
+  if (has_feature(VIRTIO_BLK_F_WRITE_ZEROES)) {
+    blk_max_write_zeroes_sectors = virtio_reg_read32(
+        VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SECTORS);
+    blk_write_zeroes_may_unmap =
+        virtio_reg_read8(VIRTIO_REG_DEVICE_CONFIG +
+                         VIRTIO_BLK_CONFIG_WRITE_ZEROES_MAY_UNMAP) != 0;
+  }
 
   // デバイスへの処理要求を格納する領域を確保
-  blk_req_paddr =
-      alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-  blk_req = (struct virtio_blk_req *)blk_req_paddr;
+  blk_reqs_paddr = alloc_pages(
+      align_up(sizeof(*blk_reqs) * VIRTIO_BLK_REQ_MAX, PAGE_SIZE) / PAGE_SIZE);
+  blk_reqs = (struct virtio_blk_req *)blk_reqs_paddr;
+
+  // 完了は割り込みで受け取る
+  plic_enable(VIRTIO_BLK_IRQ);
+}
+
+static int virtq_alloc_desc(struct virtio_virtq *vq) {
+  if (vq->num_free == 0)
+    return -1;
+  int index = vq->free_head;
+  vq->free_head = vq->descs[index].next;
+  vq->num_free--;
+  return index;
+}
+
+// headから始まるディスクリプタチェーンを空きリストに戻す
+static void virtq_free_chain(struct virtio_virtq *vq, int head) {
+  int index = head;
+  while (vq->descs[index].flags & VIRTQ_DESC_F_NEXT) {
+    vq->num_free++;
+    index = vq->descs[index].next;
+  }
+  vq->descs[index].next = vq->free_head;
+  vq->free_head = head;
+  vq->num_free++;
 }
 
-// send to virtqueue
-void virtq_kick(struct virtio_virtq *vq, int desc_index) {
+// availリングにチェーンを追加する。デバイスへの通知はvirtq_kickで行う
+void virtq_push(struct virtio_virtq *vq, int desc_index) {
   vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
+  __sync_synchronize();
   vq->avail.index++;
+}
+
+// bufsをつないだチェーンをidとしてデバイスに渡す。ディスクリプタが
+// 足りなければ-1を返す
+int virtq_add_chain(struct virtio_virtq *vq, const struct virtq_buf *bufs,
+                    int n, uint16_t id) {
+  if (n <= 0 || vq->num_free < n)
+    return -1;
+
+  if (vq->is_packed) {
+    // packed: リング上の連続した位置に書く。先頭のフラグを最後に書くことで、
+    // デバイスが書きかけのチェーンを見ないようにする
+    uint16_t head = vq->next_avail;
+    uint16_t head_flags = 0;
+    for (int i = 0; i < n; i++) {
+      struct virtq_packed_desc *d = &vq->packed.ring[vq->next_avail];
+      uint16_t flags = vq->avail_wrap_counter ? VIRTQ_DESC_F_AVAIL
+                                              : VIRTQ_DESC_F_USED;
+      if (i < n - 1)
+        flags |= VIRTQ_DESC_F_NEXT;
+      if (bufs[i].device_writable)
+        flags |= VIRTQ_DESC_F_WRITE;
+      if (bufs[i].indirect)
+        flags |= VIRTQ_DESC_F_INDIRECT;
+      d->addr = bufs[i].addr;
+      d->len = bufs[i].len;
+      d->id = id;
+      if (i == 0)
+        head_flags = flags;
+      else
+        d->flags = flags;
+
+      if (++vq->next_avail == VIRTQ_ENTRY_NUM) {
+        vq->next_avail = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+      }
+    }
+    vq->chain_len[id] = n;
+    vq->num_free -= n;
+    vq->num_added += n;
+    __sync_synchronize();
+    *(volatile uint16_t *)&vq->packed.ring[head].flags = head_flags;
+    return 0;
+  }
+
+  int head = virtq_alloc_desc(vq);
+  int prev = head;
+  for (int i = 0; i < n; i++) {
+    int d = i == 0 ? head : virtq_alloc_desc(vq);
+    if (i > 0) {
+      vq->descs[prev].next = d;
+      vq->descs[prev].flags |= VIRTQ_DESC_F_NEXT;
+    }
+    vq->descs[d].addr = bufs[i].addr;
+    vq->descs[d].len = bufs[i].len;
+    vq->descs[d].flags = (bufs[i].device_writable ? VIRTQ_DESC_F_WRITE : 0) |
+                         (bufs[i].indirect ? VIRTQ_DESC_F_INDIRECT : 0);
+    prev = d;
+  }
+  vq->head_id[head] = id;
+  virtq_push(vq, head);
+  return 0;
+}
+
+// bufsを間接ディスクリプタテーブルtableに書き、リングのエントリを1つだけ
+// 使ってデバイスに渡す。tableはリングと同じ形式で、完了まで保持すること
+int virtq_add_indirect(struct virtio_virtq *vq, const struct virtq_buf *bufs,
+                       int n, uint16_t id, void *table, paddr_t table_paddr) {
+  if (vq->is_packed) {
+    struct virtq_packed_desc *descs = table;
+    for (int i = 0; i < n; i++) {
+      descs[i].addr = bufs[i].addr;
+      descs[i].len = bufs[i].len;
+      descs[i].id = 0;
+      descs[i].flags = bufs[i].device_writable ? VIRTQ_DESC_F_WRITE : 0;
+    }
+  } else {
+    struct virtq_desc *descs = table;
+    for (int i = 0; i < n; i++) {
+      descs[i].addr = bufs[i].addr;
+      descs[i].len = bufs[i].len;
+      descs[i].flags = bufs[i].device_writable ? VIRTQ_DESC_F_WRITE : 0;
+      if (i < n - 1) {
+        descs[i].flags |= VIRTQ_DESC_F_NEXT;
+        descs[i].next = i + 1;
+      }
+    }
+  }
+
+  struct virtq_buf buf = {.addr = table_paddr,
+                          .len = n * sizeof(struct virtq_desc),
+                          .device_writable = false,
+                          .indirect = true};
+  return virtq_add_chain(vq, &buf, 1, id);
+}
+
+static bool virtq_has_used(struct virtio_virtq *vq) {
+  if (!vq->is_packed)
+    return vq->last_used_index != *vq->used_index;
+
+  // packed: AVAILとUSEDの両方がラップカウンタと一致していれば完了済み
+  uint16_t flags =
+      *(volatile uint16_t *)&vq->packed.ring[vq->last_used_index].flags;
+  bool avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+  bool used = (flags & VIRTQ_DESC_F_USED) != 0;
+  return avail == vq->used_wrap_counter && used == vq->used_wrap_counter;
+}
+
+// 完了したチェーンを1つ回収してそのIDを返す。なければ-1を返す
+int virtq_get_used(struct virtio_virtq *vq) {
+  if (!virtq_has_used(vq))
+    return -1;
   __sync_synchronize();
-  virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
+
+  if (vq->is_packed) {
+    // デバイスはチェーンの先頭位置にIDを書き戻し、チェーンの長さ分だけ進む
+    uint16_t id = vq->packed.ring[vq->last_used_index].id;
+    vq->num_free += vq->chain_len[id];
+    vq->last_used_index += vq->chain_len[id];
+    if (vq->last_used_index >= VIRTQ_ENTRY_NUM) {
+      vq->last_used_index -= VIRTQ_ENTRY_NUM;
+      vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return id;
+  }
+
+  struct virtq_used_elem *elem =
+      &vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM];
+  int head = elem->id;
   vq->last_used_index++;
+  virtq_free_chain(vq, head);
+  return vq->head_id[head];
 }
 
-bool virtq_is_busy(struct virtio_virtq *vq) {
-  return vq->last_used_index != *vq->used_index;
+// EVENT_IDX: 回収済みの次の完了で割り込むよう伝える。回収するまでの間に
+// 完了したものについては割り込みが来ないので、書き込んだ後に確認し直す。
+// まだ回収していない完了があればtrueを返す
+static bool virtq_enable_used_event(struct virtio_virtq *vq) {
+  if (vq->event_idx) {
+    if (vq->is_packed)
+      *(volatile uint16_t *)&vq->packed.driver_event.off_wrap =
+          vq->last_used_index | (vq->used_wrap_counter << 15);
+    else
+      *(volatile uint16_t *)&vq->avail.used_event = vq->last_used_index;
+    __sync_synchronize();
+  }
+  return virtq_has_used(vq);
 }
 
-void read_write_disk(void *buf, unsigned sector, int is_write) {
-  if (sector >= blk_capacity / SECTOR_SIZE) {
-    printf("virtio: tried to read/write sector=%d, but capacity is %lld\n",
-           sector, blk_capacity / SECTOR_SIZE);
+// packed: 最後に通知した位置からnext_availまでの間にデバイスが指定した
+// イベント位置があるときだけ通知する
+static void virtq_kick_packed(struct virtio_virtq *vq) {
+  if (vq->num_added == 0)
+    return;
+  uint16_t new_index = vq->next_avail;
+  uint16_t old_index = new_index - vq->num_added;
+  vq->num_added = 0;
+  __sync_synchronize();
+
+  uint16_t off_wrap = *(volatile uint16_t *)&vq->packed.device_event.off_wrap;
+  uint16_t flags = *(volatile uint16_t *)&vq->packed.device_event.flags;
+  if (flags == VIRTQ_EVENT_F_DISABLE)
     return;
+  if (vq->event_idx && flags == VIRTQ_EVENT_F_DESC) {
+    uint16_t event = off_wrap & ~(1 << 15);
+    // 1周前の位置を指していれば、今の周回の座標に直す
+    if ((bool)(off_wrap >> 15) != vq->avail_wrap_counter)
+      event -= VIRTQ_ENTRY_NUM;
+    if ((uint16_t)(new_index - event - 1) >= (uint16_t)(new_index - old_index))
+      return;
   }
 
-  // virtio-blkの仕様に従って、リクエストを構築する
-  blk_req->sector = sector;
-  blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-  if (is_write)
-    memcpy(blk_req->data, buf, SECTOR_SIZE);
+  virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
+}
+
+// まだ通知していないチェーンがあれば、デバイスに通知する。
+// EVENT_IDXを使う場合、デバイスが指定したavail_eventをまだ越えていなければ、
+// デバイスは前回の通知分を処理中なのでMMIOへの書き込みを省略できる
+void virtq_kick(struct virtio_virtq *vq) {
+  if (vq->is_packed) {
+    virtq_kick_packed(vq);
+    return;
+  }
+
+  uint16_t old_index = vq->notified_avail_index;
+  uint16_t new_index = vq->avail.index;
+  if (old_index == new_index)
+    return;
+  vq->notified_avail_index = new_index;
+  __sync_synchronize();
+
+  if (vq->event_idx) {
+    uint16_t event = *(volatile uint16_t *)&vq->used.avail_event;
+    if ((uint16_t)(new_index - event - 1) >= (uint16_t)(new_index - old_index))
+      return;
+  } else if (*(volatile uint16_t *)&vq->used.flags & VIRTQ_USED_F_NO_NOTIFY) {
+    return;
+  }
 
-  // virtqueueのディスクリプタを構築する (3つのディスクリプタを使う)
+  virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
+}
+
+// plugしている間に発行したリクエストは、unplugするか完了を待つまで
+// デバイスに通知しない。まとめて発行するときの通知回数を減らす
+void virtio_blk_plug(void) { blk_plug_depth++; }
+
+void virtio_blk_unplug(void) {
+  if (--blk_plug_depth == 0)
+    virtq_kick(blk_request_vq);
+}
+
+// カーネル領域はどのページテーブルでも仮想アドレス=物理アドレスでマップされて
+// いるので、その範囲にあるバッファはデバイスに直接渡せる。virtio自体には
+// バッファのアライメント制約はない
+static bool is_dma_capable(const void *buf, uint32_t len) {
+  paddr_t start = (paddr_t)buf;
+  return start >= (paddr_t)__kernel_base &&
+         start + len <= (paddr_t)__free_ram_end;
+}
+
+static int alloc_blk_slot(void) {
+  for (int i = 0; i < VIRTIO_BLK_REQ_MAX; i++) {
+    if (!blk_slots[i].used)
+      return i;
+  }
+  return -1;
+}
+
+// typeのリクエストを発行する。データはsegsの順に並べて転送する。
+// 完了を待たずに戻るので、ioと各バッファは完了まで保持すること
+static int submit_blk_req(struct virtio_blk_io *io, uint32_t type,
+                          unsigned sector, const struct virtio_blk_seg *segs,
+                          int nsegs) {
+  io->done = false;
+  io->status = VIRTIO_BLK_S_OK;
+  // IN以外はデバイスがデータを読む側
+  int is_write = type != VIRTIO_BLK_T_IN;
+  // 読み書き以外のデータはセクタの内容ではない (DISCARD等の範囲指定)
+  bool is_rw = type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT;
+
+  uint32_t total = 0;
+  for (int i = 0; i < nsegs; i++)
+    total += segs[i].len;
+  unsigned count = is_rw ? total / SECTOR_SIZE : 0;
+
+  if (nsegs < 0 || nsegs > VIRTIO_BLK_SEG_MAX ||
+      total > VIRTIO_BLK_MAX_SECTORS * SECTOR_SIZE ||
+      (is_rw && (nsegs == 0 || total % SECTOR_SIZE != 0))) {
+    printf("virtio: invalid request: nsegs=%d len=%d\n", nsegs, total);
+    io->status = VIRTIO_BLK_S_IOERR;
+    io->done = true;
+    return -1;
+  }
+
+  if (sector + count > blk_capacity / SECTOR_SIZE) {
+    printf("virtio: tried to read/write sector=%d, but capacity is %lld\n",
+           sector + count - 1, blk_capacity / SECTOR_SIZE);
+    io->status = VIRTIO_BLK_S_IOERR;
+    io->done = true;
+    return -1;
+  }
+
+  // 空きスロットとディスクリプタができるまで、完了済みのリクエストを回収しつつ待つ
   struct virtio_virtq *vq = blk_request_vq;
-  vq->descs[0].addr = blk_req_paddr;
-  vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-  vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-  vq->descs[0].next = 1;
+  int slot;
+  virtio_blk_poll();
+  int ndescs = vq->indirect ? 1 : nsegs + 2;
+  while ((slot = alloc_blk_slot()) < 0 || vq->num_free < ndescs) {
+    virtq_kick(vq);
+    sleep_on(&blk_wait_queue);
+    virtio_blk_poll();
+  }
+
+  // virtio-blkの仕様に従って、リクエストを構築する
+  struct virtio_blk_req *req = &blk_reqs[slot];
+  paddr_t req_paddr = blk_reqs_paddr + slot * sizeof(*req);
+  req->sector = sector;
+  req->type = type;
+  req->status = 0xff;
+
+  // ヘッダ、データ (セグメントごとに1つ)、ステータスの順につなぐ
+  struct virtq_buf bufs[VIRTIO_BLK_SEG_MAX + 2];
+  bufs[0] = (struct virtq_buf){
+      .addr = req_paddr + offsetof(struct virtio_blk_req, type),
+      .len = sizeof(uint32_t) * 2 + sizeof(uint64_t),
+      .device_writable = false};
+
+  // データ用ディスクリプタは呼び出し側のバッファを直接指す。
+  // デバイスから見えないバッファだけ、スロットのバウンスバッファを経由させる
+  struct blk_req_slot *s = &blk_slots[slot];
+  uint32_t bounce_used = 0;
+  for (int i = 0; i < nsegs; i++) {
+    paddr_t addr;
+    if (is_dma_capable(segs[i].buf, segs[i].len)) {
+      addr = (paddr_t)segs[i].buf;
+      s->bounce_offset[i] = -1;
+    } else {
+      if (is_write)
+        memcpy(req->data + bounce_used, segs[i].buf, segs[i].len);
+      addr = req_paddr + offsetof(struct virtio_blk_req, data) + bounce_used;
+      s->bounce_offset[i] = bounce_used;
+      bounce_used += segs[i].len;
+    }
+
+    bufs[i + 1] = (struct virtq_buf){
+        .addr = addr, .len = segs[i].len, .device_writable = !is_write};
+  }
 
-  vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-  vq->descs[1].len = SECTOR_SIZE;
-  vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-  vq->descs[1].next = 2;
+  bufs[nsegs + 1] = (struct virtq_buf){
+      .addr = req_paddr + offsetof(struct virtio_blk_req, status),
+      .len = sizeof(uint8_t),
+      .device_writable = true};
 
-  vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-  vq->descs[2].len = sizeof(uint8_t);
-  vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+  s->used = true;
+  s->io = io;
+  for (int i = 0; i < nsegs; i++)
+    s->segs[i] = segs[i];
+  s->nsegs = nsegs;
+  s->is_write = is_write;
+
+  // 間接ディスクリプタが使えれば、テーブルをスロットに置いて1エントリで渡す
+  if (vq->indirect)
+    virtq_add_indirect(vq, bufs, nsegs + 2, slot, &req->indirect,
+                       req_paddr + offsetof(struct virtio_blk_req, indirect));
+  else
+    virtq_add_chain(vq, bufs, nsegs + 2, slot);
 
   // デバイスに新しいリクエストがあることを通知する
-  virtq_kick(vq, 0);
+  if (blk_plug_depth == 0)
+    virtq_kick(vq);
+  return 0;
+}
+
+// 連続したセクタへの読み書きを発行する
+int virtio_blk_submit_sg(struct virtio_blk_io *io, unsigned sector,
+                         const struct virtio_blk_seg *segs, int nsegs,
+                         int is_write) {
+  return submit_blk_req(io, is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                        sector, segs, nsegs);
+}
 
-  // デバイス側の処理が終わるまで待つ
-  while (virtq_is_busy(vq))
-    ;
+int virtio_blk_submit(struct virtio_blk_io *io, void *buf, unsigned sector,
+                      unsigned count, int is_write) {
+  struct virtio_blk_seg seg = {.buf = buf, .len = count * SECTOR_SIZE};
+  return virtio_blk_submit_sg(io, sector, &seg, 1, is_write);
+}
+
+static void complete_blk_req(int slot) {
+  struct blk_req_slot *s = &blk_slots[slot];
+  struct virtio_blk_req *req = &blk_reqs[slot];
 
   // virtio-blk: 0でない値が返ってきたらエラー
-  if (blk_req->status != 0) {
-    printf("virtio: warn: failed to read/write sector=%d status=%d\n", sector,
-           blk_req->status);
-    return;
+  if (req->status != VIRTIO_BLK_S_OK) {
+    printf("virtio: warn: failed to read/write sector=%d status=%d\n",
+           (unsigned)req->sector, req->status);
+  } else if (!s->is_write) {
+    // バウンスバッファ経由で読み込んだ分だけ、呼び出し側にコピーする
+    for (int i = 0; i < s->nsegs; i++) {
+      if (s->bounce_offset[i] >= 0)
+        memcpy(s->segs[i].buf, req->data + s->bounce_offset[i],
+               s->segs[i].len);
+    }
   }
 
-  // 読み込み処理の場合は、バッファにデータをコピーする
-  if (!is_write)
-    memcpy(buf, blk_req->data, SECTOR_SIZE);
+  s->used = false;
+  s->io->status = req->status;
+  s->io->done = true;
+}
+
+// usedリングに返ってきたリクエストを回収し、待っているプロセスを起こす
+void virtio_blk_poll(void) {
+  struct virtio_virtq *vq = blk_request_vq;
+  bool completed = false;
+  do {
+    int slot;
+    while ((slot = virtq_get_used(vq)) >= 0) {
+      complete_blk_req(slot);
+      completed = true;
+    }
+  } while (virtq_enable_used_event(vq));
+
+  if (completed)
+    wake_up(&blk_wait_queue);
+}
+
+// 完了割り込みのハンドラ
+void virtio_blk_handle_irq(void) {
+  uint32_t status = virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS);
+  virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK, status);
+  virtio_blk_poll();
+}
+
+// リクエストの完了を待つ。失敗していたら-1を返す
+// 待っている間は眠り、完了割り込みで起こされる
+int virtio_blk_wait(struct virtio_blk_io *io) {
+  virtq_kick(blk_request_vq);
+  virtio_blk_poll();
+  while (!io->done) {
+    sleep_on(&blk_wait_queue);
+    virtio_blk_poll();
+  }
+  return io->status == VIRTIO_BLK_S_OK ? 0 : -1;
+}
+
+// デバイスの書き込みキャッシュを書き出すリクエストを発行する。
+// これより前に完了した書き込みは、このリクエストの完了時に永続化されている
+int virtio_blk_submit_flush(struct virtio_blk_io *io) {
+  return submit_blk_req(io, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
+
+// 書き込みキャッシュを書き出し、完了まで待つ。
+// FLUSHを持たないデバイスは書き込みを完了時に永続化しているので何もしない
+int virtio_blk_flush(void) {
+  if (!has_feature(VIRTIO_BLK_F_FLUSH))
+    return 0;
+  struct virtio_blk_io io;
+  if (virtio_blk_submit_flush(&io) < 0)
+    return -1;
+  return virtio_blk_wait(&io);
+}
+
+// sectorからcountセクタをDISCARDかWRITE_ZEROESで処理し、完了まで待つ。
+// 1リクエストで扱える上限ごとに分けて発行する
+static int range_req(uint32_t type, unsigned sector, unsigned count,
+                     uint32_t max_sectors, uint32_t flags) {
+  if (sector + count > blk_capacity / SECTOR_SIZE)
+    return -1;
+
+  while (count > 0) {
+    unsigned n = count < max_sectors ? count : max_sectors;
+    struct virtio_blk_discard_write_zeroes range = {
+        .sector = sector, .num_sectors = n, .flags = flags};
+    struct virtio_blk_seg seg = {.buf = &range, .len = sizeof(range)};
+    struct virtio_blk_io io;
+    // 範囲はsegで渡す。ヘッダのsectorはIN/OUT以外では使わず0にする決まり
+    if (submit_blk_req(&io, type, 0, &seg, 1) < 0 ||
+        virtio_blk_wait(&io) < 0)
+      return -1;
+    sector += n;
+    count -= n;
+  }
+  return 0;
+}
+
+// 使わなくなったセクタをデバイスに伝える。ホスト側のイメージが
+// 疎であれば領域が解放される。対応していなければ何もしない
+int virtio_blk_discard(unsigned sector, unsigned count) {
+  if (!has_feature(VIRTIO_BLK_F_DISCARD) || blk_max_discard_sectors == 0)
+    return 0;
+  return range_req(VIRTIO_BLK_T_DISCARD, sector, count,
+                   blk_max_discard_sectors, 0);
+}
+
+// データを転送せずにセクタを0で埋める。対応していなければ-1を返すので、
+// 呼び出し側で0を書き込むこと
+int virtio_blk_write_zeroes(unsigned sector, unsigned count) {
+  if (!has_feature(VIRTIO_BLK_F_WRITE_ZEROES) ||
+      blk_max_write_zeroes_sectors == 0)
+    return -1;
+  uint32_t flags =
+      blk_write_zeroes_may_unmap ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+  return range_req(VIRTIO_BLK_T_WRITE_ZEROES, sector, count,
+                   blk_max_write_zeroes_sectors, flags);
+}
+
+// countセクタをまとめて読み書きし、完了まで待つ
+int read_write_disk_range(void *buf, unsigned sector, unsigned count,
+                          int is_write) {
+  struct virtio_blk_io io;
+  if (virtio_blk_submit(&io, buf, sector, count, is_write) < 0)
+    return -1;
+  return virtio_blk_wait(&io);
+}
+
+void read_write_disk(void *buf, unsigned sector, int is_write) {
+  read_write_disk_range(buf, sector, 1, is_write);
+}
+
+#ifdef BLK_BENCH
+// ベンチマーク: 同時に発行できるだけのリクエストを発行し続けてIOPSを測る。
+// timeはQEMU virtでは10MHzで進む
+#define BLK_BENCH_REQS 4096
+#define BLK_BENCH_TICKS_PER_MS 10000
+
+static uint8_t blk_bench_buf[VIRTIO_BLK_REQ_MAX][PAGE_SIZE];
+
+static void blk_bench_run(unsigned count) {
+  struct virtio_blk_io ios[VIRTIO_BLK_REQ_MAX];
+  unsigned span = blk_capacity / SECTOR_SIZE / count;
+  uint32_t start = READ_CSR(time);
+  for (int i = 0; i < BLK_BENCH_REQS + VIRTIO_BLK_REQ_MAX; i++) {
+    int n = i % VIRTIO_BLK_REQ_MAX;
+    if (i >= VIRTIO_BLK_REQ_MAX && virtio_blk_wait(&ios[n]) < 0)
+      PANIC("blk-bench: I/O error");
+    if (i < BLK_BENCH_REQS)
+      virtio_blk_submit(&ios[n], blk_bench_buf[n], (i % span) * count, count,
+                        false);
+  }
+  uint32_t ms = (READ_CSR(time) - start) / BLK_BENCH_TICKS_PER_MS;
+  if (ms == 0)
+    ms = 1;
+  printf("blk-bench: %s, %d bytes x %d: %d ms, %d IOPS\n",
+         blk_request_vq->is_packed ? "packed" : "split", count * SECTOR_SIZE,
+         BLK_BENCH_REQS, ms, BLK_BENCH_REQS * 1000 / ms);
+}
+
+void virtio_blk_bench(void) {
+  blk_bench_run(1);
+  blk_bench_run(PAGE_SIZE / SECTOR_SIZE);
 }
+#endif
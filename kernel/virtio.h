@@ -7,9 +7,14 @@
 #define VIRTQ_ENTRY_NUM 16
 #define VIRTIO_DEVICE_BLK 2
 #define VIRTIO_BLK_PADDR 0x10001000
+#define VIRTIO_BLK_IRQ 1
 #define VIRTIO_REG_MAGIC 0x00
 #define VIRTIO_REG_VERSION 0x04
 #define VIRTIO_REG_DEVICE_ID 0x08
+#define VIRTIO_REG_DEVICE_FEATURES 0x10
+#define VIRTIO_REG_DEVICE_FEATURES_SEL 0x14
+#define VIRTIO_REG_DRIVER_FEATURES 0x20
+#define VIRTIO_REG_DRIVER_FEATURES_SEL 0x24
 #define VIRTIO_REG_QUEUE_SEL 0x30
 #define VIRTIO_REG_QUEUE_NUM_MAX 0x34
 #define VIRTIO_REG_QUEUE_NUM 0x38
@@ -17,17 +22,63 @@
 #define VIRTIO_REG_QUEUE_PFN 0x40
 #define VIRTIO_REG_QUEUE_READY 0x44
 #define VIRTIO_REG_QUEUE_NOTIFY 0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK 0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
+// 以下は version 2 (modern) のみ
+#define VIRTIO_REG_QUEUE_DESC_LOW 0x80
+#define VIRTIO_REG_QUEUE_DESC_HIGH 0x84
+#define VIRTIO_REG_QUEUE_DRIVER_LOW 0x90
+#define VIRTIO_REG_QUEUE_DRIVER_HIGH 0x94
+#define VIRTIO_REG_QUEUE_DEVICE_LOW 0xa0
+#define VIRTIO_REG_QUEUE_DEVICE_HIGH 0xa4
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
+// virtio-blkのデバイス設定領域内のオフセット
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_WRITEBACK 32
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD_SECTORS 36
+#define VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SECTORS 48
+#define VIRTIO_BLK_CONFIG_WRITE_ZEROES_MAY_UNMAP 56
 #define VIRTIO_STATUS_ACK 1
 #define VIRTIO_STATUS_DRIVER 2
 #define VIRTIO_STATUS_DRIVER_OK 4
 #define VIRTIO_STATUS_FEAT_OK 8
 #define VIRTQ_DESC_F_NEXT 1
 #define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+// packed virtqueueのディスクリプタフラグ
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
+#define VIRTQ_EVENT_F_ENABLE 0
+#define VIRTQ_EVENT_F_DISABLE 1
+#define VIRTQ_EVENT_F_DESC 2
+// 機能ビット (ビット番号)
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_CONFIG_WCE 11
+#define VIRTIO_BLK_F_DISCARD 13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
+#define VIRTIO_F_VERSION_1 32
+#define VIRTIO_F_RING_PACKED 34
 #define VIRTIO_BLK_T_IN 0
 #define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_DISCARD 11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+
+// 同時に発行できるリクエストの数。間接ディスクリプタを使えば1リクエストが
+// リングのエントリを1つしか使わないので、リングの大きさまで発行できる。
+// 使えないときは空きディスクリプタの数で制限される
+#define VIRTIO_BLK_REQ_MAX VIRTQ_ENTRY_NUM
+// 1リクエストで転送できるセクタ数と、データ用ディスクリプタ (セグメント) の数
+#define VIRTIO_BLK_MAX_SECTORS 64
+#define VIRTIO_BLK_SEG_MAX 8
 
 struct virtq_desc {
   uint64_t addr;
@@ -40,6 +91,7 @@ struct virtq_avail {
   uint16_t flags;
   uint16_t index;
   uint16_t ring[VIRTQ_ENTRY_NUM];
+  uint16_t used_event; // VIRTIO_RING_F_EVENT_IDX
 } __attribute__((packed));
 
 struct virtq_used_elem {
@@ -51,28 +103,127 @@ struct virtq_used {
   uint16_t flags;
   uint16_t index;
   struct virtq_used_elem ring[VIRTQ_ENTRY_NUM];
+  uint16_t avail_event; // VIRTIO_RING_F_EVENT_IDX
+} __attribute__((packed));
+
+// packed virtqueueのディスクリプタ。ドライバが書いたリングの同じ位置に
+// デバイスが完了を書き戻す
+struct virtq_packed_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t id;
+  uint16_t flags;
+} __attribute__((packed));
+
+struct virtq_packed_event {
+  uint16_t off_wrap; // ビット15がラップカウンタ
+  uint16_t flags;
 } __attribute__((packed));
 
 struct virtio_virtq {
-  struct virtq_desc descs[VIRTQ_ENTRY_NUM];
-  struct virtq_avail avail;
-  struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
+  union {
+    // split virtqueue
+    struct {
+      struct virtq_desc descs[VIRTQ_ENTRY_NUM];
+      struct virtq_avail avail;
+      struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
+    };
+    // packed virtqueue (VIRTIO_F_RING_PACKED)
+    struct {
+      struct virtq_packed_desc ring[VIRTQ_ENTRY_NUM];
+      struct virtq_packed_event driver_event;
+      struct virtq_packed_event device_event;
+    } packed;
+  };
   int queue_index;
   volatile uint16_t *used_index;
-  uint16_t last_used_index;
+  uint16_t last_used_index; // packedではリング上の次に回収する位置
+  uint16_t free_head; // 空きディスクリプタのリスト (nextでつなぐ)
+  uint16_t num_free;
+  uint16_t notified_avail_index; // 最後にデバイスへ通知したときのavail.index
+  bool event_idx;
+  bool indirect; // VIRTIO_RING_F_INDIRECT_DESC
+  bool is_packed;
+  // packed virtqueueの状態
+  uint16_t next_avail;     // 次にディスクリプタを書く位置
+  bool avail_wrap_counter;
+  bool used_wrap_counter;
+  uint16_t num_added;      // 最後の通知以降に書いたディスクリプタの数
+  uint16_t chain_len[VIRTQ_ENTRY_NUM]; // バッファIDごとのディスクリプタ数
+  // split virtqueue: 先頭ディスクリプタごとのバッファID
+  uint16_t head_id[VIRTQ_ENTRY_NUM];
 } __attribute__((packed));
 
+// チェーンを構成するバッファ (リングの形式によらない)
+struct virtq_buf {
+  paddr_t addr;
+  uint32_t len;
+  bool device_writable;
+  bool indirect; // addrは間接ディスクリプタテーブルを指す
+};
+
 struct virtio_blk_req {
+  // 間接ディスクリプタテーブル (ヘッダ、データ、ステータスの分)
+  union {
+    struct virtq_desc split[VIRTIO_BLK_SEG_MAX + 2];
+    struct virtq_packed_desc packed[VIRTIO_BLK_SEG_MAX + 2];
+  } indirect;
   uint32_t type;
   uint32_t reserved;
   uint64_t sector;
-  uint8_t data[512];
+  uint8_t data[VIRTIO_BLK_MAX_SECTORS * SECTOR_SIZE];
   uint8_t status;
+} __attribute__((packed, aligned(16)));
+
+// DISCARD / WRITE_ZEROESで処理するセクタの範囲
+struct virtio_blk_discard_write_zeroes {
+  uint64_t sector;
+  uint32_t num_sectors;
+  uint32_t flags;
 } __attribute__((packed));
 
+// 非同期リクエストの完了通知を受け取るハンドル (呼び出し側が確保する)
+struct virtio_blk_io {
+  volatile bool done;
+  uint8_t status;
+};
+
+// スキャッタギャザー転送のバッファ断片 (lenはセクタサイズの倍数)
+struct virtio_blk_seg {
+  void *buf;
+  uint32_t len;
+};
+
+// ディスクの容量 (バイト)
+extern uint64_t blk_capacity;
+
 void virtio_blk_init(void);
-void virtq_kick(struct virtio_virtq *vq, int desc_index);
-bool virtq_is_busy(struct virtio_virtq *vq);
+void virtq_push(struct virtio_virtq *vq, int desc_index);
+int virtq_add_chain(struct virtio_virtq *vq, const struct virtq_buf *bufs,
+                    int n, uint16_t id);
+int virtq_add_indirect(struct virtio_virtq *vq, const struct virtq_buf *bufs,
+                       int n, uint16_t id, void *table, paddr_t table_paddr);
+int virtq_get_used(struct virtio_virtq *vq);
+void virtq_kick(struct virtio_virtq *vq);
+int virtio_blk_submit_sg(struct virtio_blk_io *io, unsigned sector,
+                         const struct virtio_blk_seg *segs, int nsegs,
+                         int is_write);
+int virtio_blk_submit(struct virtio_blk_io *io, void *buf, unsigned sector,
+                      unsigned count, int is_write);
+int virtio_blk_submit_flush(struct virtio_blk_io *io);
+int virtio_blk_flush(void);
+int virtio_blk_discard(unsigned sector, unsigned count);
+int virtio_blk_write_zeroes(unsigned sector, unsigned count);
+int virtio_blk_wait(struct virtio_blk_io *io);
+void virtio_blk_poll(void);
+void virtio_blk_handle_irq(void);
+void virtio_blk_plug(void);
+void virtio_blk_unplug(void);
+int read_write_disk_range(void *buf, unsigned sector, unsigned count,
+                          int is_write);
 void read_write_disk(void *buf, unsigned sector, int is_write);
+#ifdef BLK_BENCH
+void virtio_blk_bench(void);
+#endif
 
 #endif
@@ -56,10 +56,13 @@ int main(void) {
         printf("\x1b[31mFile not found: %s\n\x1b[39m", filename);
         continue;
       }
-      int ch, last = '\0';
-      while ((ch = fgetc(fp)) != EOF) {
-        putchar((char)ch);
-        last = ch;
+      // ファイルの内容はまとめて読み込む
+      char buf[512];
+      int n, last = '\0';
+      while ((n = read(fp->fd, buf, sizeof(buf))) > 0) {
+        for (int p = 0; p < n; p++)
+          putchar(buf[p]);
+        last = buf[n - 1];
       }
       if (last != '\n') {
         printf("\xE2\x8F\x8E\n");
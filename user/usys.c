@@ -24,12 +24,30 @@ int syscall(int sysno, int arg0, int arg1, int arg2) {
   return a0;
 }
 
+// 引数が4つのシステムコール。4つ目はa4で渡す
+int syscall4(int sysno, int arg0, int arg1, int arg2, int arg3) {
+  register int a0 __asm__("a0") = arg0;
+  register int a1 __asm__("a1") = arg1;
+  register int a2 __asm__("a2") = arg2;
+  register int a3 __asm__("a3") = sysno;
+  register int a4 __asm__("a4") = arg3;
+
+  __asm__ __volatile__("ecall"
+                       : "=r"(a0)
+                       : "r"(a0), "r"(a1), "r"(a2), "r"(a3), "r"(a4)
+                       : "memory");
+
+  return a0;
+}
+
 void putchar(char ch) { syscall(SYS_PUTCHAR, ch, 0, 0); }
 void __common_putc(char ch) __attribute__((alias("putchar")));
 
 int getchar(void) { return syscall(SYS_GETCHAR, 0, 0, 0); }
 
 __attribute__((noreturn)) void exit(int status) {
+  // バッファに残っている書き込みを書き出してから終了する
+  fflush(NULL);
   syscall(SYS_EXIT, status, 0, 0);
   for (;;)
     ; // 念のため
@@ -41,6 +59,29 @@ void sys_concat_first_file(void) { syscall(SYS_CAT_FIRST_FILE, 0, 0, 0); }
 
 void sys_shutdown(void) { syscall(SYS_SHUTDOWN, 0, 0, 0); }
 
+// fdの現在位置から最大nバイトを1回のシステムコールで読み書きする
+int read(int fd, void *buf, int n) {
+  return syscall(SYS_READ, fd, (int)buf, n);
+}
+
+int write(int fd, const void *buf, int n) {
+  return syscall(SYS_WRITE, fd, (int)buf, n);
+}
+
+// fdの現在位置をwhenceからoffsetバイトの位置に移し、新しい位置を返す
+int lseek(int fd, int offset, int whence) {
+  return syscall(SYS_LSEEK, fd, offset, whence);
+}
+
+// offsetの位置から読み書きする。fdの現在位置は変わらない
+int pread(int fd, void *buf, int n, int offset) {
+  return syscall4(SYS_PREAD, fd, (int)buf, n, offset);
+}
+
+int pwrite(int fd, const void *buf, int n, int offset) {
+  return syscall4(SYS_PWRITE, fd, (int)buf, n, offset);
+}
+
 #define USER_OPEN_FILES 8
 static FILE file_table[USER_OPEN_FILES];
 static bool file_table_initialized;
@@ -60,9 +101,16 @@ FILE *fopen(const char *path, const char *mode) {
     return NULL;
 
   for (int i = 0; i < USER_OPEN_FILES; i++) {
-    if (file_table[i].fd < 0) {
-      file_table[i].fd = fd;
-      return &file_table[i];
+    FILE *fp = &file_table[i];
+    if (fp->fd < 0) {
+      fp->fd = fd;
+      fp->buf_mode = _IOFBF;
+      fp->buf = fp->default_buf;
+      fp->buf_size = BUFSIZ;
+      fp->buf_pos = 0;
+      fp->buf_len = 0;
+      fp->writing = false;
+      return fp;
     }
   }
 
@@ -70,23 +118,238 @@ FILE *fopen(const char *path, const char *mode) {
   return NULL;
 }
 
+// バッファリングの方式を変える。bufがNULLならFILEに内蔵のバッファを使う
+int setvbuf(FILE *fp, char *buf, int mode, int size) {
+  if (!fp || fp->fd < 0 || mode < _IOFBF || mode > _IONBF)
+    return -1;
+  if (fflush(fp) < 0)
+    return -1;
+
+  fp->buf_mode = mode;
+  if (buf && size > 0) {
+    fp->buf = buf;
+    fp->buf_size = size;
+  } else {
+    fp->buf = fp->default_buf;
+    fp->buf_size = BUFSIZ;
+  }
+  fp->buf_pos = 0;
+  fp->buf_len = 0;
+  return 0;
+}
+
+// 書き込み待ちのデータを書き出す。読み込み用に先読みしたデータは捨て、
+// 先読みした分だけ進んでいるカーネル側の位置を読んだ所まで戻す
+static int flush_file(FILE *fp) {
+  int ret = 0;
+  if (fp->writing && fp->buf_pos > 0) {
+    if (write(fp->fd, fp->buf, fp->buf_pos) != fp->buf_pos)
+      ret = -1;
+  } else if (!fp->writing && fp->buf_pos < fp->buf_len) {
+    if (lseek(fp->fd, fp->buf_pos - fp->buf_len, SEEK_CUR) < 0)
+      ret = -1;
+  }
+  fp->writing = false;
+  fp->buf_pos = 0;
+  fp->buf_len = 0;
+  return ret;
+}
+
+// fpがNULLなら開いているすべてのファイルを書き出す
+int fflush(FILE *fp) {
+  if (fp)
+    return fp->fd < 0 ? -1 : flush_file(fp);
+
+  int ret = 0;
+  for (int i = 0; file_table_initialized && i < USER_OPEN_FILES; i++) {
+    if (file_table[i].fd >= 0 && flush_file(&file_table[i]) < 0)
+      ret = -1;
+  }
+  return ret;
+}
+
 int fclose(FILE *fp) {
   if (!fp || fp->fd < 0)
     return -1;
 
-  int ret = syscall(SYS_FCLOSE, fp->fd, 0, 0);
+  int ret = flush_file(fp);
+  if (syscall(SYS_FCLOSE, fp->fd, 0, 0) < 0)
+    ret = -1;
   fp->fd = -1;
   return ret;
 }
 
+// 読み込みバッファが空なら、カーネルから次の分を読み込む
+static int fill_buffer(FILE *fp) {
+  if (fp->writing && flush_file(fp) < 0)
+    return -1;
+  if (fp->buf_pos < fp->buf_len)
+    return 0;
+
+  int n = read(fp->fd, fp->buf, fp->buf_size);
+  fp->buf_pos = 0;
+  fp->buf_len = n > 0 ? n : 0;
+  return n > 0 ? 0 : -1;
+}
+
+int fread(void *ptr, int size, int nmemb, FILE *fp) {
+  if (!fp || fp->fd < 0 || size <= 0 || nmemb <= 0)
+    return 0;
+
+  char *dst = ptr;
+  int total = size * nmemb;
+  int done = 0;
+  while (done < total) {
+    if (fp->buf_pos < fp->buf_len) {
+      int n = fp->buf_len - fp->buf_pos;
+      if (n > total - done)
+        n = total - done;
+      memcpy(dst + done, fp->buf + fp->buf_pos, n);
+      fp->buf_pos += n;
+      done += n;
+      continue;
+    }
+
+    // 残りがバッファより大きければ、バッファを経由せずに直接読む
+    if (fp->buf_mode == _IONBF || total - done >= fp->buf_size) {
+      if (fp->writing && flush_file(fp) < 0)
+        break;
+      int n = read(fp->fd, dst + done, total - done);
+      if (n <= 0)
+        break;
+      done += n;
+      continue;
+    }
+
+    if (fill_buffer(fp) < 0)
+      break;
+  }
+  return done / size;
+}
+
 int fgetc(FILE *fp) {
   if (!fp || fp->fd < 0)
     return EOF;
-  return syscall(SYS_FGETC, fp->fd, 0, 0);
+  if (fp->buf_mode == _IONBF) {
+    if (fp->writing && flush_file(fp) < 0)
+      return EOF;
+    return syscall(SYS_FGETC, fp->fd, 0, 0);
+  }
+  if (fill_buffer(fp) < 0)
+    return EOF;
+  return (uint8_t)fp->buf[fp->buf_pos++];
+}
+
+// 改行か終端までを読み込む。何も読めなければNULLを返す
+char *fgets(char *s, int n, FILE *fp) {
+  if (!s || n <= 0)
+    return NULL;
+
+  int i = 0;
+  while (i < n - 1) {
+    int ch = fgetc(fp);
+    if (ch == EOF)
+      break;
+    s[i++] = ch;
+    if (ch == '\n')
+      break;
+  }
+  s[i] = '\0';
+  return i > 0 ? s : NULL;
+}
+
+// 書き込みの準備をする。先読みしたデータが残っていれば捨て、
+// 読んだ所の直後から書き込むようにする
+static void begin_write(FILE *fp) {
+  if (!fp->writing) {
+    flush_file(fp);
+    fp->writing = true;
+  }
+}
+
+int fwrite(const void *ptr, int size, int nmemb, FILE *fp) {
+  if (!fp || fp->fd < 0 || size <= 0 || nmemb <= 0)
+    return 0;
+
+  const char *src = ptr;
+  int total = size * nmemb;
+  int done = 0;
+  begin_write(fp);
+  while (done < total) {
+    // バッファに収まらない書き込みはバッファを書き出してから直接渡す
+    if (fp->buf_mode == _IONBF ||
+        (fp->buf_pos == 0 && total - done >= fp->buf_size)) {
+      int n = write(fp->fd, src + done, total - done);
+      if (n <= 0)
+        break;
+      done += n;
+      continue;
+    }
+
+    int n = fp->buf_size - fp->buf_pos;
+    if (n > total - done)
+      n = total - done;
+    memcpy(fp->buf + fp->buf_pos, src + done, n);
+    fp->buf_pos += n;
+    done += n;
+    if (fp->buf_pos == fp->buf_size && flush_file(fp) < 0)
+      break;
+    begin_write(fp);
+  }
+
+  if (fp->buf_mode == _IOLBF) {
+    for (int i = 0; i < done; i++) {
+      if (src[i] == '\n') {
+        flush_file(fp);
+        break;
+      }
+    }
+  }
+  return done / size;
 }
 
 int fputc(FILE *fp, int ch) {
   if (!fp || fp->fd < 0)
     return -1;
-  return syscall(SYS_FPUTC, fp->fd, ch, 0);
+  if (fp->buf_mode == _IONBF)
+    return syscall(SYS_FPUTC, fp->fd, ch, 0);
+
+  begin_write(fp);
+  fp->buf[fp->buf_pos++] = ch;
+  if (fp->buf_pos == fp->buf_size ||
+      (fp->buf_mode == _IOLBF && ch == '\n')) {
+    if (flush_file(fp) < 0)
+      return -1;
+  }
+  return ch & 0xff;
+}
+
+int fputs(const char *s, FILE *fp) {
+  int len = 0;
+  while (s[len])
+    len++;
+  if (fwrite(s, 1, len, fp) != len)
+    return EOF;
+  return len;
+}
+
+// 読み書きする位置を移す。バッファの内容は書き出すか捨てる
+int fseek(FILE *fp, int offset, int whence) {
+  if (!fp || fp->fd < 0)
+    return -1;
+  if (flush_file(fp) < 0)
+    return -1;
+  return lseek(fp->fd, offset, whence) < 0 ? -1 : 0;
+}
+
+// 次に読み書きする位置を返す。バッファの中身の分も数える
+int ftell(FILE *fp) {
+  if (!fp || fp->fd < 0)
+    return -1;
+  int pos = lseek(fp->fd, 0, SEEK_CUR);
+  if (pos < 0)
+    return -1;
+  if (fp->writing)
+    return pos + fp->buf_pos;
+  return pos - (fp->buf_len - fp->buf_pos);
 }
@@ -8,6 +8,7 @@ __attribute__((noreturn)) void exit(int status);
 void putchar(char ch);
 int getchar(void);
 int syscall(int sysno, int arg0, int arg1, int arg2);
+int syscall4(int sysno, int arg0, int arg1, int arg2, int arg3);
 int create_file(const char *name, const uint8_t *data, uint32_t size);
 void sys_list_root_dir(void);
 void sys_concat_first_file(void);
@@ -18,5 +19,18 @@ FILE *fopen(const char *path, const char *mode);
 int fclose(FILE *fp);
 int fgetc(FILE *fp);
 int fputc(FILE *fp, int ch);
+int read(int fd, void *buf, int n);
+int write(int fd, const void *buf, int n);
+int lseek(int fd, int offset, int whence);
+int pread(int fd, void *buf, int n, int offset);
+int pwrite(int fd, const void *buf, int n, int offset);
+int setvbuf(FILE *fp, char *buf, int mode, int size);
+int fflush(FILE *fp);
+int fread(void *ptr, int size, int nmemb, FILE *fp);
+int fwrite(const void *ptr, int size, int nmemb, FILE *fp);
+char *fgets(char *s, int n, FILE *fp);
+int fputs(const char *s, FILE *fp);
+int fseek(FILE *fp, int offset, int whence);
+int ftell(FILE *fp);
 
 #endif